@@ -6,58 +6,219 @@
 #include <linux/stat.h>
 #include <linux/init.h>
 #include <linux/device.h>
+#include <linux/slab.h>
 #include <linux/blk_types.h>
 #include <linux/blkdev.h>
 #include <linux/blk-mq.h>
+#include <linux/cpumask.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/llist.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/idr.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/version.h>
 #include <uapi/linux/hdreg.h> //for struct hd_geometry
 #include <uapi/linux/cdrom.h> //for CDROM_GET_CAPABILITY
 
+#include "domblockdev.h"
+
+#define CREATE_TRACE_POINTS
+#include "domblockdev_trace.h"
+
 // constants - instead defines
 static const char* _device_name = "domblockdev";
-static const size_t _buffer_size = 16 * PAGE_SIZE;
-
-// types
-typedef struct domblockdev_cmd_s {
-} domblockdev_cmd_t;
-
-// The internal representation of our device
-typedef struct domblockdev_device_s {
-	sector_t capacity;              // Device size in bytes
-	u8* data;			// The data aray. u8 - 8 bytes
-	atomic_t open_counter;          // How many openers
-	struct blk_mq_tag_set tag_set;
-	struct request_queue *queue;	// For mutual exclusion
-	struct gendisk *disk;		// The gendisk structure
-} domblockdev_device_t;
+#define DOMBLOCKDEV_MINORS	16	// the whole disk and up to 15 partitions
+#define DOMBLOCKDEV_MAX_DEVICES	((MINORMASK + 1) / DOMBLOCKDEV_MINORS)
+
+// module parameters
+static unsigned int nr_devices = 1;
+module_param(nr_devices, uint, S_IRUGO);
+MODULE_PARM_DESC(nr_devices, "Number of disks to create at load time, more can be added under /sys/kernel/domblockdev");
+
+static unsigned int nr_hw_queues = 0;
+module_param(nr_hw_queues, uint, S_IRUGO);
+MODULE_PARM_DESC(nr_hw_queues, "Number of hardware queues (0 = one per possible CPU)");
+
+static unsigned int poll_queues = 0;
+module_param(poll_queues, uint, S_IRUGO);
+MODULE_PARM_DESC(poll_queues, "Number of extra hardware queues for polled I/O (io_uring IOPOLL, RWF_HIPRI)");
+
+// queue limits, 0 keeps the block layer default. They show up under /sys/block/<disk>/queue once the disk exists.
+static unsigned int logical_block_size = 0;
+module_param(logical_block_size, uint, S_IRUGO);
+MODULE_PARM_DESC(logical_block_size, "Logical block size in bytes, 512 up to PAGE_SIZE");
+
+static unsigned int physical_block_size = 0;
+module_param(physical_block_size, uint, S_IRUGO);
+MODULE_PARM_DESC(physical_block_size, "Physical block size in bytes, at least logical_block_size");
+
+static unsigned int max_hw_sectors = 0;
+module_param(max_hw_sectors, uint, S_IRUGO);
+MODULE_PARM_DESC(max_hw_sectors, "Largest request in 512 byte sectors");
+
+static unsigned short max_segments = 0;
+module_param(max_segments, ushort, S_IRUGO);
+MODULE_PARM_DESC(max_segments, "Most segments in one request");
+
+static unsigned int max_segment_size = 0;
+module_param(max_segment_size, uint, S_IRUGO);
+MODULE_PARM_DESC(max_segment_size, "Largest segment in bytes, at least PAGE_SIZE");
+
+static unsigned int io_opt = 0;
+module_param(io_opt, uint, S_IRUGO);
+MODULE_PARM_DESC(io_opt, "Optimal I/O size in bytes reported to filesystems and tools");
+
+static char *capacity = "16M";
+module_param(capacity, charp, S_IRUGO);
+MODULE_PARM_DESC(capacity, "Disk size, with optional K/M/G suffix (backing pages are allocated on first write)");
+
+static int home_node = NUMA_NO_NODE; // "numa_node" itself is taken by <linux/topology.h>
+module_param_named(numa_node, home_node, int, S_IRUGO);
+MODULE_PARM_DESC(numa_node, "Place backing pages and queues on this NUMA node (-1 = follow the submitting CPU)");
+
+static bool numa_interleave = false;
+module_param(numa_interleave, bool, S_IRUGO);
+MODULE_PARM_DESC(numa_interleave, "Spread backing pages round robin across all online NUMA nodes");
+
+static char *compression = "";
+module_param(compression, charp, S_IRUGO);
+MODULE_PARM_DESC(compression, "Keep pages compressed with this crypto algorithm, e.g. lz4 (empty = off)");
+
+static bool dedup = false;
+module_param(dedup, bool, S_IRUGO);
+MODULE_PARM_DESC(dedup, "Store identical pages only once, shared copy-on-write");
+
+// Here and not in domblockdev_zoned.c, which isn't built without CONFIG_BLK_DEV_ZONED, so zoned=1 can say why it fails
+static bool zoned = false;
+module_param(zoned, bool, S_IRUGO);
+MODULE_PARM_DESC(zoned, "Emulate a host-managed zoned device (zone_size and zone_count set the layout)");
 
 // global variables 
 static int _domblockdev_major = 0;
-static domblockdev_device_t* _domblockdev_device = NULL;
+static LIST_HEAD(_domblockdev_devices);	// every disk we have, under _domblockdev_lock
+static DEFINE_MUTEX(_domblockdev_lock);
+static DEFINE_IDA(_domblockdev_ida);		// disk numbers in use
+static struct kobject *_domblockdev_kobj = NULL;	// /sys/kernel/domblockdev
+static struct dentry *_domblockdev_debugfs = NULL;
 
 // functions
 static int domblockdev_allocate_buffer(domblockdev_device_t* dev) {
-	dev->capacity = _buffer_size >> SECTOR_SHIFT;
-	dev->data = kmalloc(dev->capacity << SECTOR_SHIFT, GFP_KERNEL); //
-	if (dev->data == NULL) {
-		printk(KERN_WARNING "domblockdev: vmalloc failure\n");
+	unsigned long long size = memparse(capacity, NULL);
+	int ret;
+
+	size = round_down(size, PAGE_SIZE);
+	domblockdev_store_init(dev, size >> SECTOR_SHIFT);
+	if (size == 0) {
+		printk(KERN_WARNING "domblockdev: Invalid capacity \"%s\"\n", capacity);
+		return -EINVAL;
+	}
+
+	if (home_node != NUMA_NO_NODE && (home_node < 0 || home_node >= nr_node_ids || !node_online(home_node))) {
+		printk(KERN_WARNING "domblockdev: NUMA node %d is not online\n", home_node);
+		return -EINVAL;
+	}
+	dev->numa_node = home_node;
+	if (numa_interleave && home_node == NUMA_NO_NODE)
+		dev->interleave_nodes = node_states[N_MEMORY];
+
+	dev->node_pages = kcalloc(nr_node_ids, sizeof(atomic_long_t), GFP_KERNEL);
+	if (dev->node_pages == NULL)
 		return -ENOMEM;
+
+	if (zoned) {
+		if (!IS_ENABLED(CONFIG_BLK_DEV_ZONED)) {
+			printk(KERN_WARNING "domblockdev: zoned=1 needs a kernel built with CONFIG_BLK_DEV_ZONED\n");
+			return -EOPNOTSUPP;
+		}
+		ret = domblockdev_zoned_init(dev);
+		if (ret)
+			return ret;
+	}
+	ret = domblockdev_cache_init(dev);
+	if (ret)
+		return ret;
+
+	if (compression && *compression && dedup) {
+		printk(KERN_WARNING "domblockdev: compression and dedup can not be used together\n");
+		return -EINVAL;
+	}
+	if (dev->cache && (dev->zoned || dedup || (compression && *compression))) {
+		printk(KERN_WARNING "domblockdev: cache_file can not be used with zoned, dedup or compression\n");
+		return -EINVAL;
 	}
+	if (compression && *compression)
+		return domblockdev_comp_init(dev, compression);
+	if (dedup)
+		return domblockdev_dedup_init(dev);
 
 	return 0;
 }
 
-static void domblockdev_free_buffer(domblockdev_device_t* dev) {
-	if (dev->data) {
-		kfree(dev->data);
-		dev->data = NULL;
-		dev->capacity = 0;
+// Check the queue limit parameters before anything gets allocated
+static int domblockdev_check_limits(void) {
+	unsigned int lbs = logical_block_size ? logical_block_size : SECTOR_SIZE;
+
+	if (!is_power_of_2(lbs) || lbs < SECTOR_SIZE || lbs > PAGE_SIZE) {
+		printk(KERN_WARNING "domblockdev: Invalid logical_block_size %u\n", logical_block_size);
+		return -EINVAL;
+	}
+	if (physical_block_size && (!is_power_of_2(physical_block_size) || physical_block_size < lbs)) {
+		printk(KERN_WARNING "domblockdev: Invalid physical_block_size %u\n", physical_block_size);
+		return -EINVAL;
+	}
+	if (max_hw_sectors && max_hw_sectors < PAGE_SIZE >> SECTOR_SHIFT) {
+		printk(KERN_WARNING "domblockdev: Invalid max_hw_sectors %u\n", max_hw_sectors);
+		return -EINVAL;
+	}
+	if (max_segment_size && max_segment_size < PAGE_SIZE) {
+		printk(KERN_WARNING "domblockdev: Invalid max_segment_size %u\n", max_segment_size);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+// Apply the queue limit parameters. With 4k logical blocks every segment lines up with
+// exactly one backing page, so do_simple_request never has to split a copy.
+static void domblockdev_set_limits(struct request_queue *queue) {
+	if (logical_block_size)
+		blk_queue_logical_block_size(queue, logical_block_size);
+	if (physical_block_size) {
+		blk_queue_physical_block_size(queue, physical_block_size);
+		blk_queue_io_min(queue, physical_block_size);
 	}
+	if (max_hw_sectors)
+		blk_queue_max_hw_sectors(queue, max_hw_sectors);
+	if (max_segments)
+		blk_queue_max_segments(queue, max_segments);
+	if (max_segment_size)
+		blk_queue_max_segment_size(queue, max_segment_size);
+	if (io_opt)
+		blk_queue_io_opt(queue, io_opt);
 }
 
-static void domblockdev_remove_device(void) {
-	domblockdev_device_t* dev = _domblockdev_device;
-	if (dev == NULL)
-		return;
+static void domblockdev_free_buffer(domblockdev_device_t* dev) {
+	domblockdev_store_free(dev);
+	domblockdev_zoned_free(dev);
+}
+
+// Called with _domblockdev_lock held
+static void domblockdev_remove_device(domblockdev_device_t* dev) {
+	list_del(&dev->list);
+
+	debugfs_remove_recursive(dev->debugfs_dir);
+	dev->debugfs_dir = NULL;
+
+	if (dev->disk) {
+		domblockdev_cache_sysfs_exit(dev);
+		domblockdev_dedup_sysfs_exit(dev);
+		domblockdev_comp_sysfs_exit(dev);
+		domblockdev_snapshot_exit(dev);
+	}
 
 	if (dev->disk)
 		del_gendisk(dev->disk);
@@ -76,60 +237,343 @@ static void domblockdev_remove_device(void) {
 	}
 
 	domblockdev_free_buffer(dev);
+	kfree(dev->queues);
+	kfree(dev->node_pages);
+	ida_free(&_domblockdev_ida, dev->index);
+	printk(KERN_WARNING "domblockdev: The block device %d was removed!\n", dev->index);
 	kfree(dev);
-	_domblockdev_device = NULL;
-	printk(KERN_WARNING "domblockdev: The block device was removed!\n");
 }
 
-static int do_simple_request(struct request *rq, unsigned int *nr_bytes) {
+static int do_simple_request(domblockdev_queue_t *q, struct request *rq, unsigned int *nr_bytes, unsigned int *nr_segs) {
 	int ret = 0;
 	struct bio_vec bvec;
 	struct req_iterator iter;
-	domblockdev_device_t *dev = rq->q->queuedata;
-	loff_t pos = blk_rq_pos(rq) << SECTOR_SHIFT;
-	loff_t dev_size = (loff_t)(dev->capacity << SECTOR_SHIFT);
-
-	printk(KERN_WARNING "domblockdev: Request start from sector %lld \n", blk_rq_pos(rq));
+	domblockdev_device_t *dev = q->dev;
+	sector_t sector = blk_rq_pos(rq);
+
+	switch (req_op(rq)) {
+	case REQ_OP_READ:
+		break;
+	case REQ_OP_WRITE:
+		if (dev->zoned && (ret = domblockdev_zoned_write(dev, rq)))
+			return ret;
+		break;
+#ifdef DOMBLOCKDEV_HAVE_ZONE_APPEND
+	case REQ_OP_ZONE_APPEND: // copy to wherever the write pointer was
+		ret = domblockdev_zoned_write(dev, rq);
+		if (ret)
+			return ret;
+		sector = blk_rq_pos(rq);
+		break;
+#endif
+	case REQ_OP_ZONE_RESET_ALL: // too slow for here, _queue_rq hands it to domblockdev_zoned_reset_all
+		return dev->zoned ? -EINPROGRESS : -EOPNOTSUPP;
+	case REQ_OP_ZONE_RESET:
+#ifdef DOMBLOCKDEV_HAVE_ZONE_MGMT
+	case REQ_OP_ZONE_OPEN:
+	case REQ_OP_ZONE_CLOSE:
+	case REQ_OP_ZONE_FINISH:
+#endif
+		return domblockdev_zoned_mgmt(dev, rq);
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES: // both free the backing pages, so discarded sectors read back as zeros
+		if (sector + blk_rq_sectors(rq) > dev->capacity)
+			return -EIO;
+		ret = domblockdev_store_zero(dev, sector, blk_rq_sectors(rq));
+		if (ret == 0)
+			*nr_bytes = blk_rq_bytes(rq);
+		return ret;
+	case REQ_OP_FLUSH: // RAM has no volatile cache in front of it, everything is already "on disk"
+		return dev->cache ? domblockdev_cache_flush(dev) : 0; // unless we cache a file
+	default:
+		return -EOPNOTSUPP;
+	}
 
 	rq_for_each_segment(bvec, rq, iter) {
-		unsigned long b_len = bvec.bv_len;
-		void* b_buf = page_address(bvec.bv_page) + bvec.bv_offset;
+		unsigned int b_len = bvec.bv_len;
+
+		if (sector >= dev->capacity)
+			return -EIO;
+		if (sector + (b_len >> SECTOR_SHIFT) > dev->capacity)
+			b_len = (dev->capacity - sector) << SECTOR_SHIFT;
 
-		if ((pos + b_len) > dev_size)
-			b_len = (unsigned long)(dev_size - pos);
 		if (rq_data_dir(rq)) //WRITE data to ramdisk
-			memcpy(dev->data + pos, b_buf, b_len);
+			ret = domblockdev_store_write(dev, sector, bvec.bv_page, bvec.bv_offset, b_len);
 		else //READ data from ramdisk
-			memcpy(b_buf, dev->data + pos, b_len);
+			ret = domblockdev_store_read(dev, sector, bvec.bv_page, bvec.bv_offset, b_len);
+		if (ret) {
+			// A zoned write has claimed its sectors already. blk-mq only retries it if they can be given back.
+			if (ret == -ENOMEM && dev->zoned && rq_data_dir(rq) && !domblockdev_zoned_unclaim(dev, rq))
+				ret = -EIO;
+			return ret;
+		}
 
-		pos += b_len;
+		sector += b_len >> SECTOR_SHIFT;
 		*nr_bytes += b_len;
+		(*nr_segs)++;
 	}
 
 	return ret;
 }
 
+// End every request on list, oldest first
+static int domblockdev_end_list(struct llist_node *list) {
+	domblockdev_cmd_t *cmd, *next;
+	int nr = 0;
+
+	llist_for_each_entry_safe(cmd, next, llist_reverse_order(list), node) {
+		struct request *rq = blk_mq_rq_from_pdu(cmd);
+
+		domblockdev_hist_end(rq);
+		blk_mq_end_request(rq, cmd->status);
+		nr++;
+	}
+
+	return nr;
+}
+
 static blk_status_t _queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data* bd) {
-	unsigned int nr_bytes = 0;
-	blk_status_t status = BLK_STS_OK;
+	unsigned int nr_bytes = 0, nr_segs = 0;
 	struct request *rq = bd->rq;
+	domblockdev_cmd_t *cmd = blk_mq_rq_to_pdu(rq);
+	domblockdev_queue_t *q = hctx->driver_data;
+	int ret;
 	blk_mq_start_request(rq); //we cannot use any locks that make the thread sleep
 
-	if (do_simple_request(rq, &nr_bytes) != 0)
-		status = BLK_STS_IOERR;
+	ret = do_simple_request(q, rq, &nr_bytes, &nr_segs);
+	switch (ret) {
+	case 0:
+		cmd->status = BLK_STS_OK;
+		break;
+	case -ENOMEM: // out of backing pages for now, blk-mq requeues and tries again later
+		return BLK_STS_RESOURCE;
+	case -EINPROGRESS: // a work item finishes and completes it, rq is not ours after the hand-off
+		atomic64_inc(&q->zone_ops);
+		trace_domblockdev_request(rq, q->index, 0);
+		domblockdev_hist_queue(q, rq, 0);
+		domblockdev_zoned_reset_all(q, rq);
+		return BLK_STS_OK;
+	default:
+		atomic64_inc(&q->errors);
+		cmd->status = errno_to_blk_status(ret);
+		goto done;
+	}
+
+	switch (req_op(rq)) {
+	case REQ_OP_READ:
+		atomic64_inc(&q->reads);
+		atomic64_add(nr_bytes, &q->read_bytes);
+		break;
+	case REQ_OP_WRITE:
+#ifdef DOMBLOCKDEV_HAVE_ZONE_APPEND
+	case REQ_OP_ZONE_APPEND:
+#endif
+		atomic64_inc(&q->writes);
+		atomic64_add(nr_bytes, &q->write_bytes);
+		break;
+	case REQ_OP_FLUSH:
+		atomic64_inc(&q->flushes);
+		break;
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		atomic64_inc(&q->discards);
+		break;
+	default:
+		atomic64_inc(&q->zone_ops);
+		break;
+	}
 
-	printk(KERN_WARNING "domblockdev: Request process %d bytes\n", nr_bytes);
+done:
+	trace_domblockdev_request(rq, q->index, nr_bytes);
+	domblockdev_hist_queue(q, rq, nr_segs);
 
-	if (blk_update_request(rq, status, nr_bytes)) //GPL-only symbol
-		BUG();
-		
-	__blk_mq_end_request(rq, status);
+	// The data has been copied already, with a latency model the timer completes the request later
+	if (domblockdev_latency_enabled())
+		domblockdev_latency_start(q->dev, rq, nr_bytes);
+	else
+		domblockdev_complete(q, rq);
 
 	return BLK_STS_OK;//always return ok
 }
 
+// Finish a request whose data has been copied. On a poll queue, leave the completion for _poll,
+// which runs in the context of the task waiting for it.
+void domblockdev_complete(domblockdev_queue_t *q, struct request *rq) {
+	domblockdev_cmd_t *cmd = blk_mq_rq_to_pdu(rq);
+
+	if (q->poll)
+		llist_add(&cmd->node, &q->poll_list);
+	else {
+		domblockdev_hist_end(rq);
+		blk_mq_end_request(rq, cmd->status);
+	}
+}
+
+static int _init_request(struct blk_mq_tag_set *set, struct request *rq, unsigned int hctx_idx, unsigned int numa_node) {
+	domblockdev_latency_init_cmd(blk_mq_rq_to_pdu(rq));
+	return 0;
+}
+
+// Complete everything parked on this poll queue. Returns how many requests were completed.
+static int _poll(struct blk_mq_hw_ctx *hctx) {
+	domblockdev_queue_t *q = hctx->driver_data;
+	struct llist_node *list = llist_del_all(&q->poll_list);
+
+	if (list == NULL)
+		return 0;
+
+	return domblockdev_end_list(list);
+}
+
+// Give each hardware context its own domblockdev_queue_t, allocated on the hctx's node.
+// blk-mq picks that node from the CPUs mapped to the queue, see _map_queues.
+static int _init_hctx(struct blk_mq_hw_ctx *hctx, void *driver_data, unsigned int hctx_idx) {
+	domblockdev_device_t *dev = driver_data;
+	domblockdev_queue_t *q = kzalloc_node(sizeof(domblockdev_queue_t), GFP_KERNEL, hctx->numa_node);
+
+	if (q == NULL)
+		return -ENOMEM;
+	if (domblockdev_hist_alloc(q, hctx->numa_node)) {
+		kfree(q);
+		return -ENOMEM;
+	}
+
+	q->dev = dev;
+	q->index = hctx_idx;
+	q->poll = hctx_idx >= dev->nr_queues - dev->nr_poll_queues;
+	init_llist_head(&q->poll_list);
+	hctx->driver_data = q;
+	dev->queues[hctx_idx] = q;
+
+	return 0;
+}
+
+static void _exit_hctx(struct blk_mq_hw_ctx *hctx, unsigned int hctx_idx) {
+	domblockdev_queue_t *q = hctx->driver_data;
+
+	q->dev->queues[hctx_idx] = NULL;
+	hctx->driver_data = NULL;
+	domblockdev_hist_free(q);
+	kfree(q);
+}
+
+static unsigned int domblockdev_node_cpus(unsigned int node) {
+	unsigned int cpu, nr = 0;
+
+	for_each_cpu_and(cpu, cpumask_of_node(node), cpu_possible_mask)
+		nr++;
+	return nr;
+}
+
+// Map CPUs to hardware queues so that a queue only ever serves CPUs of one node.
+// Every node gets at least one queue of its own. The rest go out one at a time, each to the node
+// with the most CPUs per queue so far, which shares them in proportion to the nodes' CPU counts.
+// A node never gets more queues than it has CPUs, such a queue would have no CPU and sit idle with
+// its tags, so with more queues than CPUs the last ones go unused. Each node's CPUs are spread
+// over its queues and blk-mq then allocates each hctx and its tags on that node. With fewer
+// queues than nodes that can't work, so whole nodes share a queue instead, but a node is still
+// never split over queues of other nodes.
+static void domblockdev_map_queues_numa(struct blk_mq_queue_map *map) {
+	unsigned int nr_nodes = 0, left = 0, base = 0, n = 0, cpu, node;
+	unsigned int *cpus, *queues;	// per node, nr_node_ids each
+	cpumask_var_t mapped;
+
+	if (nr_node_ids == 1 || !zalloc_cpumask_var(&mapped, GFP_KERNEL)) {
+		blk_mq_map_queues(map);
+		return;
+	}
+	cpus = kcalloc(2 * nr_node_ids, sizeof(*cpus), GFP_KERNEL);
+	if (cpus == NULL) {
+		free_cpumask_var(mapped);
+		blk_mq_map_queues(map);
+		return;
+	}
+	queues = cpus + nr_node_ids;
+
+	for_each_node_state(node, N_CPU) {
+		cpus[node] = domblockdev_node_cpus(node);
+		if (cpus[node]) {
+			queues[node] = 1;
+			nr_nodes++;
+		}
+	}
+	if (map->nr_queues > nr_nodes)
+		left = map->nr_queues - nr_nodes;
+	while (left) {
+		unsigned int best = MAX_NUMNODES;
+
+		for_each_node_state(node, N_CPU) {
+			if (queues[node] >= cpus[node])
+				continue; // every CPU of the node has a queue already
+			if (best == MAX_NUMNODES || cpus[node] * queues[best] > cpus[best] * queues[node])
+				best = node;
+		}
+		if (best == MAX_NUMNODES)
+			break;
+		queues[best]++;
+		left--;
+	}
+
+	for_each_node_state(node, N_CPU) {
+		unsigned int first, nr, i = 0;
+
+		if (cpus[node] == 0)
+			continue;
+
+		if (map->nr_queues < nr_nodes) {
+			first = n % map->nr_queues;
+			nr = 1;
+		}
+		else {
+			first = base;
+			nr = queues[node];
+			base += nr;
+		}
+		for_each_cpu_and(cpu, cpumask_of_node(node), cpu_possible_mask) {
+			map->mq_map[cpu] = map->queue_offset + first + i++ % nr;
+			cpumask_set_cpu(cpu, mapped);
+		}
+		n++;
+	}
+
+	// CPUs that are possible but not yet attached to a node
+	for_each_possible_cpu(cpu)
+		if (!cpumask_test_cpu(cpu, mapped))
+			map->mq_map[cpu] = map->queue_offset + cpu % map->nr_queues;
+
+	kfree(cpus);
+	free_cpumask_var(mapped);
+}
+
+// The default queues come first, then the poll queues. HCTX_TYPE_READ shares the default queues.
+static int _map_queues(struct blk_mq_tag_set *set) {
+	domblockdev_device_t *dev = set->driver_data;
+	struct blk_mq_queue_map *map;
+
+	map = &set->map[HCTX_TYPE_DEFAULT];
+	map->nr_queues = dev->nr_queues - dev->nr_poll_queues;
+	map->queue_offset = 0;
+	domblockdev_map_queues_numa(map);
+
+	if (set->nr_maps > HCTX_TYPE_POLL) {
+		set->map[HCTX_TYPE_READ].nr_queues = 0;
+
+		map = &set->map[HCTX_TYPE_POLL];
+		map->nr_queues = dev->nr_poll_queues;
+		map->queue_offset = dev->nr_queues - dev->nr_poll_queues;
+		domblockdev_map_queues_numa(map);
+	}
+
+	return 0;
+}
+
 static struct blk_mq_ops _mq_ops = {
 	.queue_rq = _queue_rq,
+	.init_request = _init_request,
+	.init_hctx = _init_hctx,
+	.exit_hctx = _exit_hctx,
+	.map_queues = _map_queues,
+	.poll = _poll,
 };
 
 static int _open(struct block_device *bdev, fmode_t mode) {
@@ -138,18 +582,21 @@ static int _open(struct block_device *bdev, fmode_t mode) {
 		printk(KERN_WARNING "domblockdev: Invalid disk private_data\n");
 		return -ENXIO;
 	}
-	atomic_inc(&dev->open_counter);
-	printk(KERN_WARNING "domblockdev: Device was opened\n");
+	mutex_lock(&dev->snapshot_lock);
+	if (dev->removing) {
+		mutex_unlock(&dev->snapshot_lock);
+		return -ENXIO;
+	}
+	trace_domblockdev_open(bdev->bd_disk, atomic_inc_return(&dev->open_counter));
+	mutex_unlock(&dev->snapshot_lock);
 
 	return 0;
 }
 
 static void _release(struct gendisk *disk, fmode_t mode) {
 	domblockdev_device_t* dev = disk->private_data;
-	if (dev) {
-		atomic_dec(&dev->open_counter);
-		printk(KERN_WARNING "domblockdev: Device was closed\n");
-	}
+	if (dev)
+		trace_domblockdev_release(disk, atomic_dec_return(&dev->open_counter));
 	else
 		printk(KERN_WARNING "domblockdev: Invalid disk private_data\n");
 }
@@ -181,7 +628,6 @@ static int _getgeo(domblockdev_device_t* dev, struct hd_geometry* geo) {
 static int _ioctl(struct block_device *bdev, fmode_t mode, unsigned int cmd, unsigned long arg) {
 	int ret = -ENOTTY;
 	domblockdev_device_t* dev = bdev->bd_disk->private_data;
-	printk(KERN_WARNING "domblockdev: ioctl %x received\n", cmd);
 
 	switch (cmd) {
 		case HDIO_GETGEO: {
@@ -204,39 +650,97 @@ static int _ioctl(struct block_device *bdev, fmode_t mode, unsigned int cmd, uns
 		}
 	}
 
+	trace_domblockdev_ioctl(bdev->bd_disk, cmd, ret);
 	return ret;
 }
 
+// debugfs/domblockdev/<disk_name>/stats - one line per hardware queue
+static int _stats_show(struct seq_file *s, void *unused) {
+	domblockdev_device_t* dev = s->private;
+	unsigned int i;
+
+	seq_printf(s, "%-8s %12s %12s %16s %16s %10s %10s %10s %8s\n", "hctx", "reads", "writes",
+		   "read_bytes", "write_bytes", "discards", "flushes", "zone_ops", "errors");
+	for (i = 0; i < dev->nr_queues; i++) {
+		domblockdev_queue_t *q = dev->queues[i];
+		if (q == NULL)
+			continue;
+		seq_printf(s, "%-3u %-4s %12lld %12lld %16lld %16lld %10lld %10lld %10lld %8lld\n", i, q->poll ? "poll" : "",
+			   atomic64_read(&q->reads), atomic64_read(&q->writes),
+			   atomic64_read(&q->read_bytes), atomic64_read(&q->write_bytes),
+			   atomic64_read(&q->discards), atomic64_read(&q->flushes), atomic64_read(&q->zone_ops),
+			   atomic64_read(&q->errors));
+	}
+	seq_printf(s, "backing_pages %ld\n", atomic_long_read(&dev->nr_pages));
+	for_each_online_node(i)
+		seq_printf(s, "node%u_pages %ld\n", i, atomic_long_read(&dev->node_pages[i]));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(_stats);
+
 static const struct block_device_operations _fops = {
 	.owner = THIS_MODULE,
 	.open = _open,
 	.release = _release,
 	.ioctl = _ioctl,
+#ifdef CONFIG_BLK_DEV_ZONED
+	.report_zones = domblockdev_zoned_report,
+#endif
 };
 
-// For adding the block device disk to the system
-static int domblockdev_add_device(void) {
+// For adding block device number index to the system. Called with _domblockdev_lock held.
+static int domblockdev_add_device(int index) {
 	int ret = 0;
+	domblockdev_device_t* dev;
+
+	if (index < 0 || index >= DOMBLOCKDEV_MAX_DEVICES)
+		return -EINVAL;
+	ret = ida_alloc_range(&_domblockdev_ida, index, index, GFP_KERNEL);
+	if (ret < 0)
+		return ret == -ENOSPC ? -EEXIST : ret;
 
-	domblockdev_device_t* dev = kzalloc(sizeof(domblockdev_device_t), GFP_KERNEL);
+	dev = kzalloc(sizeof(domblockdev_device_t), GFP_KERNEL);
 	if (dev == NULL) {
 		printk(KERN_WARNING "domblockdev: Failed to allocate %ld bytes\n", sizeof(domblockdev_device_t));
+		ida_free(&_domblockdev_ida, index);
 		return -ENOMEM;
 	}
-	_domblockdev_device = dev;
+	dev->index = index;
+	list_add_tail(&dev->list, &_domblockdev_devices);
+	mutex_init(&dev->snapshot_lock);
+	ret = 0;
 
 	do{
+		ret = domblockdev_check_limits();
+		if (ret)
+			break;
+
 		ret = domblockdev_allocate_buffer(dev);
 		if(ret)
 			break;          
 
+		{// allocate per hardware queue state
+			dev->nr_poll_queues = dev->cache ? 0 : min(poll_queues, nr_cpu_ids); // a cache miss sleeps, nothing to spin on
+			dev->nr_queues = nr_hw_queues ? min(nr_hw_queues, nr_cpu_ids) : nr_cpu_ids;
+			dev->nr_queues += dev->nr_poll_queues;
+			dev->queues = kcalloc(dev->nr_queues, sizeof(domblockdev_queue_t *), GFP_KERNEL);
+			if (dev->queues == NULL) {
+				printk(KERN_WARNING "domblockdev: Failed to allocate %u queues\n", dev->nr_queues);
+				ret = -ENOMEM;
+				break;
+			}
+		}
+
 		{// configure tag_set
 			dev->tag_set.ops = &_mq_ops;
-			dev->tag_set.nr_hw_queues = 1;
+			dev->tag_set.nr_hw_queues = dev->nr_queues;
+			dev->tag_set.nr_maps = dev->nr_poll_queues ? HCTX_MAX_TYPES : 1; // blk-mq turns on QUEUE_FLAG_POLL for us
 			dev->tag_set.queue_depth = 128;
-			dev->tag_set.numa_node = NUMA_NO_NODE;
+			dev->tag_set.numa_node = home_node; // only a fallback, each hctx and its tags follow the node of its CPUs
 			dev->tag_set.cmd_size = sizeof(domblockdev_cmd_t);
 			dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+			if (dev->cache)
+				dev->tag_set.flags |= BLK_MQ_F_BLOCKING; // cache misses read the backing file from _queue_rq
 			dev->tag_set.driver_data = dev;
 			
 			ret = blk_mq_alloc_tag_set(&dev->tag_set);
@@ -257,38 +761,165 @@ static int domblockdev_add_device(void) {
 		}
 		dev->queue->queuedata = dev;
 
+		{// advertise discard and write-zeroes, so mkfs and fstrim hand memory back to us, then the other limits
+			struct request_queue *queue = dev->queue;
+			if (dev->zoned == NULL && dev->cache == NULL) { // a zone reset is how a zoned disk gets memory back
+				blk_queue_flag_set(QUEUE_FLAG_DISCARD, queue);
+				queue->limits.discard_granularity = PAGE_SIZE;
+				blk_queue_max_discard_sectors(queue, DOMBLOCKDEV_MAX_DISCARD_SECTORS);
+				blk_queue_max_write_zeroes_sectors(queue, DOMBLOCKDEV_MAX_DISCARD_SECTORS);
+			}
+			if (dev->cache)
+				blk_queue_write_cache(queue, true, false); // dirty pages are lost without REQ_OP_FLUSH, FUA is emulated with it
+			domblockdev_set_limits(queue);
+		}
+
 		{// configure disk
-			struct gendisk *disk = alloc_disk(1); //only one partition 
+			struct gendisk *disk = alloc_disk(DOMBLOCKDEV_MINORS);
 			if (disk == NULL) {
 				printk(KERN_WARNING "domblockdev: Failed to allocate disk\n");
 				ret = -ENOMEM;
 				break;
 		    	}
-			disk->flags |= GENHD_FL_NO_PART_SCAN; //only one partition 
 			disk->flags |= GENHD_FL_REMOVABLE;
 			disk->major = _domblockdev_major;
-			disk->first_minor = 0;
+			disk->first_minor = index * DOMBLOCKDEV_MINORS;
 			disk->fops = &_fops;
 			disk->private_data = dev;
 			disk->queue = dev->queue;
-			sprintf(disk->disk_name, "domblockdev-%d", 0);
+			sprintf(disk->disk_name, "domblockdev-%d", index); // partitions become domblockdev-<index>p<n>
 			set_capacity(disk, dev->capacity);
 
 			dev->disk = disk;
+			ret = domblockdev_zoned_setup(dev);
+			if (ret) {
+				printk(KERN_WARNING "domblockdev: Failed to set up zones\n");
+				dev->disk = NULL; // never added, so remove_device must not delete it
+				put_disk(disk);
+				break;
+			}
 			add_disk(disk);
 		}
-		printk(KERN_WARNING "domblockdev: The block device was created! Congrats!\n");
+
+		ret = domblockdev_snapshot_init(dev);
+		if (ret == 0)
+			ret = domblockdev_comp_sysfs_init(dev);
+		if (ret == 0)
+			ret = domblockdev_dedup_sysfs_init(dev);
+		if (ret == 0)
+			ret = domblockdev_cache_sysfs_init(dev);
+		if (ret) {
+			printk(KERN_WARNING "domblockdev: Failed to create sysfs attributes\n");
+			break;
+		}
+
+		{// configure debugfs - failures here are not fatal
+			dev->debugfs_dir = debugfs_create_dir(dev->disk->disk_name, _domblockdev_debugfs);
+			debugfs_create_file("stats", S_IRUSR, dev->debugfs_dir, dev, &_stats_fops);
+			domblockdev_hist_debugfs_init(dev);
+		}
+		printk(KERN_WARNING "domblockdev: The block device %s was created with %u hardware queues (%u for polling)! Congrats!\n", dev->disk->disk_name, dev->nr_queues, dev->nr_poll_queues);
     	}while(false); // The reason for the do...while loop is to add individual break points for each section
 
 	if (ret){
-		domblockdev_remove_device();
+		domblockdev_remove_device(dev);
 		printk(KERN_WARNING "domblockdev: Failed add block device\n");
 	}
 
 	return ret;
 }
 
+static domblockdev_device_t* domblockdev_find_device(int index) {
+	domblockdev_device_t* dev;
+
+	list_for_each_entry(dev, &_domblockdev_devices, list)
+		if (dev->index == index)
+			return dev;
+	return NULL;
+}
+
+// Runtime control: echo N > /sys/kernel/domblockdev/add (or remove) creates or destroys domblockdev-N
+static ssize_t add_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count) {
+	int index, ret;
+
+	ret = kstrtoint(buf, 10, &index);
+	if (ret)
+		return ret;
+
+	mutex_lock(&_domblockdev_lock);
+	ret = domblockdev_add_device(index);
+	mutex_unlock(&_domblockdev_lock);
+
+	return ret ? ret : count;
+}
+
+static ssize_t remove_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count) {
+	domblockdev_device_t* dev;
+	int index, ret;
+
+	ret = kstrtoint(buf, 10, &index);
+	if (ret)
+		return ret;
+
+	mutex_lock(&_domblockdev_lock);
+	dev = domblockdev_find_device(index);
+	if (dev == NULL)
+		ret = -ENODEV;
+	else {
+		// Nobody may have it open, and nobody may open it from here on
+		mutex_lock(&dev->snapshot_lock);
+		if (atomic_read(&dev->open_counter))
+			ret = -EBUSY;
+		else
+			dev->removing = true;
+		mutex_unlock(&dev->snapshot_lock);
+		if (ret == 0)
+			domblockdev_remove_device(dev);
+	}
+	mutex_unlock(&_domblockdev_lock);
+
+	return ret ? ret : count;
+}
+
+// Lists the disk numbers in use
+static ssize_t devices_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf) {
+	domblockdev_device_t* dev;
+	ssize_t len = 0;
+
+	mutex_lock(&_domblockdev_lock);
+	list_for_each_entry(dev, &_domblockdev_devices, list)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%d\n", dev->index);
+	mutex_unlock(&_domblockdev_lock);
+
+	return len;
+}
+
+static struct kobj_attribute _add_attr = __ATTR_WO(add);
+static struct kobj_attribute _remove_attr = __ATTR_WO(remove);
+static struct kobj_attribute _devices_attr = __ATTR_RO(devices);
+
+static struct attribute *_control_attrs[] = {
+	&_add_attr.attr,
+	&_remove_attr.attr,
+	&_devices_attr.attr,
+	NULL,
+};
+
+static const struct attribute_group _control_group = {
+	.attrs = _control_attrs,
+};
+
+static void domblockdev_remove_all(void) {
+	domblockdev_device_t* dev, *next;
+
+	mutex_lock(&_domblockdev_lock);
+	list_for_each_entry_safe(dev, next, &_domblockdev_devices, list)
+		domblockdev_remove_device(dev);
+	mutex_unlock(&_domblockdev_lock);
+}
+
 static int __init domblockdev_init(void) {
+	unsigned int i;
 	int ret = 0;
 
 	_domblockdev_major = register_blkdev(_domblockdev_major, _device_name);
@@ -296,15 +927,38 @@ static int __init domblockdev_init(void) {
 		printk(KERN_WARNING "domblockdev: Unable to get major number\n");
 		return -EBUSY;
 	}
-	ret = domblockdev_add_device();
-	if (ret)
+	_domblockdev_debugfs = debugfs_create_dir(_device_name, NULL);
+
+	mutex_lock(&_domblockdev_lock);
+	for (i = 0; i < nr_devices && ret == 0; i++)
+		ret = domblockdev_add_device(i);
+	mutex_unlock(&_domblockdev_lock);
+
+	if (ret == 0) {
+		_domblockdev_kobj = kobject_create_and_add(_device_name, kernel_kobj);
+		if (_domblockdev_kobj == NULL)
+			ret = -ENOMEM;
+		else if ((ret = sysfs_create_group(_domblockdev_kobj, &_control_group)))
+			kobject_put(_domblockdev_kobj);
+	}
+
+	if (ret) {
+		domblockdev_remove_all();
+		domblockdev_latency_exit();
+		debugfs_remove_recursive(_domblockdev_debugfs);
 		unregister_blkdev(_domblockdev_major, _device_name);
+	}
         
 	return ret;
 }
 
 static void __exit domblockdev_exit(void) {
-	domblockdev_remove_device();
+	// Take the control files away first, so no add or remove can race with us
+	sysfs_remove_group(_domblockdev_kobj, &_control_group);
+	kobject_put(_domblockdev_kobj);
+	domblockdev_remove_all();
+	domblockdev_latency_exit();
+	debugfs_remove_recursive(_domblockdev_debugfs);
 	if (_domblockdev_major > 0)
 		unregister_blkdev(_domblockdev_major, _device_name);
 }
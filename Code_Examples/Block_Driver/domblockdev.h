@@ -0,0 +1,184 @@
+// Shared definitions for the domblockdev ramdisk
+
+#ifndef _DOMBLOCKDEV_H
+#define _DOMBLOCKDEV_H
+
+#include <linux/types.h>
+#include <linux/atomic.h>
+#include <linux/cache.h>
+#include <linux/xarray.h>
+#include <linux/nodemask.h>
+#include <linux/blk-mq.h>
+#include <linux/llist.h>
+#include <linux/hrtimer.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/version.h>
+
+#define DOMBLOCKDEV_PAGE_SECTORS_SHIFT	(PAGE_SHIFT - SECTOR_SHIFT)
+#define DOMBLOCKDEV_PAGE_SECTORS	(1 << DOMBLOCKDEV_PAGE_SECTORS_SHIFT)
+
+// The most sectors one discard or write-zeroes covers. domblockdev_store_zero runs in _queue_rq under
+// rcu_read_lock, where it can't reschedule, so a whole-disk trim is split up by the block layer
+// into requests that each free at most 8192 pages. Callers that may sleep walk in steps of this size.
+#define DOMBLOCKDEV_MAX_DISCARD_SECTORS	((32 * 1024 * 1024) >> SECTOR_SHIFT)
+
+// Zone open/close/finish requests arrived in 5.5, zone append in 5.8
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+#define DOMBLOCKDEV_HAVE_ZONE_MGMT
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+#define DOMBLOCKDEV_HAVE_ZONE_APPEND
+#endif
+
+// report_zones got a callback in 5.5 and lost its gfp_t in 5.4
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+#define DOMBLOCKDEV_REPORT_ZONES_ARGS struct gendisk *disk, sector_t sector, unsigned int nr_zones, report_zones_cb cb, void *data
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+#define DOMBLOCKDEV_REPORT_ZONES_ARGS struct gendisk *disk, sector_t sector, struct blk_zone *zones, unsigned int *nr_zones
+#else
+#define DOMBLOCKDEV_REPORT_ZONES_ARGS struct gendisk *disk, sector_t sector, struct blk_zone *zones, unsigned int *nr_zones, gfp_t gfp_mask
+#endif
+
+// types
+typedef struct domblockdev_comp_s domblockdev_comp_t;	// compressed store state, see domblockdev_comp.c
+typedef struct domblockdev_dedup_s domblockdev_dedup_t;	// deduplicating store state, see domblockdev_dedup.c
+typedef struct domblockdev_zoned_s domblockdev_zoned_t;	// zone layout and write pointers, see domblockdev_zoned.c
+typedef struct domblockdev_cache_s domblockdev_cache_t;	// write-back cache state, see domblockdev_cache.c
+typedef struct domblockdev_hist_s domblockdev_hist_t;	// per queue request histograms, see domblockdev_hist.c
+
+// Per request driver data, blk-mq allocates it right behind each struct request
+typedef struct domblockdev_cmd_s {
+	struct llist_node node;		// On poll_list of its domblockdev_queue_t until it is completed, or waiting for a zone reset all
+	blk_status_t status;
+	struct hrtimer timer;		// Completes the request when latency_mode is set
+	u64 start_ns;			// When the request started, for the latency histogram
+} domblockdev_cmd_t;
+
+// Per hardware queue state. Each hctx gets its own cache line so that
+// submitters on different CPUs never write to memory shared with another queue
+typedef struct domblockdev_queue_s {
+	struct domblockdev_device_s *dev;	// Back pointer to the owning device
+	unsigned int index;			// hctx index
+	bool poll;				// HCTX_TYPE_POLL queue, completions are reaped by _poll
+	struct llist_head poll_list;		// Requests that are done and waiting for _poll
+	// Counters are only touched by the CPUs mapped to this hctx, so the atomics stay uncontended
+	atomic64_t reads;
+	atomic64_t writes;
+	atomic64_t read_bytes;
+	atomic64_t write_bytes;
+	atomic64_t discards;		// REQ_OP_DISCARD and REQ_OP_WRITE_ZEROES
+	atomic64_t flushes;
+	atomic64_t zone_ops;		// Zone reset, open, close and finish
+	atomic64_t errors;
+	domblockdev_hist_t *hist;
+} ____cacheline_aligned_in_smp domblockdev_queue_t;
+
+// The internal representation of our device
+typedef struct domblockdev_device_s {
+	struct list_head list;		// On the module's list of disks
+	int index;			// N in domblockdev-N
+	bool removing;			// Being destroyed, set under snapshot_lock so no new opener gets in
+	sector_t capacity;              // Device size in sectors
+	struct xarray pages;		// Backing pages indexed by page offset, allocated on first write
+	domblockdev_comp_t *comp;	// Set in compressed mode, then pages holds compressed entries instead
+	domblockdev_dedup_t *dedup;	// Set in dedup mode, then pages holds shared page entries instead
+	domblockdev_zoned_t *zoned;	// Set in zoned mode
+	domblockdev_cache_t *cache;	// Set in cache mode, then pages holds cache entries for a backing file
+	atomic_long_t nr_pages;		// How many backing pages are allocated
+	atomic_long_t *node_pages;	// The same, per NUMA node (nr_node_ids entries)
+	int numa_node;			// Node for all backing pages, or NUMA_NO_NODE
+	nodemask_t interleave_nodes;	// Nodes to spread backing pages over, empty for local allocation
+	atomic_t open_counter;          // How many openers
+	struct mutex snapshot_lock;	// Keeps openers out while a snapshot or restore runs
+	domblockdev_queue_t **queues;	// One entry per hardware queue, each allocated on its hctx's node
+	unsigned int nr_queues;		// Total hardware queues, the last nr_poll_queues of them are poll queues
+	unsigned int nr_poll_queues;
+	struct blk_mq_tag_set tag_set;
+	struct request_queue *queue;	// For mutual exclusion
+	struct gendisk *disk;		// The gendisk structure
+	struct dentry *debugfs_dir;	// debugfs/domblockdev/<disk_name>
+	// End of the last transfer reserved under bandwidth_mbps. Every queue updates it, so keep it on its own line
+	atomic64_t bw_next_ns ____cacheline_aligned_in_smp;
+} domblockdev_device_t;
+
+// domblockdev.c
+void domblockdev_complete(domblockdev_queue_t *q, struct request *rq);
+
+// domblockdev_store.c - the page backed data store
+void domblockdev_store_init(domblockdev_device_t* dev, sector_t capacity);
+void domblockdev_store_free(domblockdev_device_t* dev);
+int domblockdev_store_write(domblockdev_device_t* dev, sector_t sector, struct page *page, unsigned int offset, unsigned int len);
+int domblockdev_store_read(domblockdev_device_t* dev, sector_t sector, struct page *page, unsigned int offset, unsigned int len);
+int domblockdev_store_zero(domblockdev_device_t* dev, sector_t sector, sector_t nr_sects);
+int domblockdev_store_node(domblockdev_device_t* dev, pgoff_t idx);
+unsigned int domblockdev_store_get_pages(domblockdev_device_t* dev, pgoff_t *idx, pgoff_t max, struct page **pages, unsigned int nr);
+int domblockdev_store_add_page(domblockdev_device_t* dev, pgoff_t idx, struct page *page);
+typedef int (*domblockdev_zero_page_fn)(domblockdev_device_t* dev, pgoff_t idx, unsigned int pg_sect, unsigned int nr);
+int domblockdev_store_zero_pages(domblockdev_device_t* dev, sector_t sector, sector_t nr_sects, domblockdev_zero_page_fn zero_page);
+
+// domblockdev_latency.c - asynchronous completions with a device latency model
+bool domblockdev_latency_enabled(void);
+void domblockdev_latency_start(domblockdev_device_t* dev, struct request *rq, unsigned int nr_bytes);
+void domblockdev_latency_init_cmd(domblockdev_cmd_t *cmd);
+void domblockdev_latency_exit(void);
+
+// domblockdev_snapshot.c - snapshot and restore of the contents to a file
+int domblockdev_snapshot_init(domblockdev_device_t* dev);
+void domblockdev_snapshot_exit(domblockdev_device_t* dev);
+
+// domblockdev_comp.c - compressed page store
+int domblockdev_comp_init(domblockdev_device_t* dev, const char *algorithm);
+void domblockdev_comp_free(domblockdev_device_t* dev);
+int domblockdev_comp_write(domblockdev_device_t* dev, sector_t sector, struct page *page, unsigned int offset, unsigned int len);
+int domblockdev_comp_read(domblockdev_device_t* dev, sector_t sector, struct page *page, unsigned int offset, unsigned int len);
+int domblockdev_comp_zero(domblockdev_device_t* dev, sector_t sector, sector_t nr_sects);
+int domblockdev_comp_sysfs_init(domblockdev_device_t* dev);
+void domblockdev_comp_sysfs_exit(domblockdev_device_t* dev);
+
+// domblockdev_dedup.c - deduplicating page store
+int domblockdev_dedup_init(domblockdev_device_t* dev);
+void domblockdev_dedup_free(domblockdev_device_t* dev);
+int domblockdev_dedup_write(domblockdev_device_t* dev, sector_t sector, struct page *page, unsigned int offset, unsigned int len);
+int domblockdev_dedup_read(domblockdev_device_t* dev, sector_t sector, struct page *page, unsigned int offset, unsigned int len);
+int domblockdev_dedup_zero(domblockdev_device_t* dev, sector_t sector, sector_t nr_sects);
+int domblockdev_dedup_sysfs_init(domblockdev_device_t* dev);
+void domblockdev_dedup_sysfs_exit(domblockdev_device_t* dev);
+
+// domblockdev_cache.c - write-back cache in front of a backing file
+int domblockdev_cache_init(domblockdev_device_t* dev);
+void domblockdev_cache_free(domblockdev_device_t* dev);
+int domblockdev_cache_write(domblockdev_device_t* dev, sector_t sector, struct page *page, unsigned int offset, unsigned int len);
+int domblockdev_cache_read(domblockdev_device_t* dev, sector_t sector, struct page *page, unsigned int offset, unsigned int len);
+int domblockdev_cache_flush(domblockdev_device_t* dev);
+int domblockdev_cache_sysfs_init(domblockdev_device_t* dev);
+void domblockdev_cache_sysfs_exit(domblockdev_device_t* dev);
+
+// domblockdev_hist.c - request histograms per hardware queue
+int domblockdev_hist_alloc(domblockdev_queue_t *q, int node);
+void domblockdev_hist_free(domblockdev_queue_t *q);
+void domblockdev_hist_queue(domblockdev_queue_t *q, struct request *rq, unsigned int nr_segs);
+void domblockdev_hist_end(struct request *rq);
+void domblockdev_hist_debugfs_init(domblockdev_device_t* dev);
+
+// domblockdev_zoned.c - zoned block device emulation, needs CONFIG_BLK_DEV_ZONED
+#ifdef CONFIG_BLK_DEV_ZONED
+int domblockdev_zoned_init(domblockdev_device_t* dev);
+int domblockdev_zoned_setup(domblockdev_device_t* dev);
+void domblockdev_zoned_free(domblockdev_device_t* dev);
+int domblockdev_zoned_write(domblockdev_device_t* dev, struct request *rq);
+bool domblockdev_zoned_unclaim(domblockdev_device_t* dev, struct request *rq);
+int domblockdev_zoned_mgmt(domblockdev_device_t* dev, struct request *rq);
+void domblockdev_zoned_reset_all(domblockdev_queue_t *q, struct request *rq);
+int domblockdev_zoned_report(DOMBLOCKDEV_REPORT_ZONES_ARGS);
+#else
+static inline int domblockdev_zoned_init(domblockdev_device_t* dev) { return -EOPNOTSUPP; }
+static inline int domblockdev_zoned_setup(domblockdev_device_t* dev) { return 0; }
+static inline void domblockdev_zoned_free(domblockdev_device_t* dev) { }
+static inline int domblockdev_zoned_write(domblockdev_device_t* dev, struct request *rq) { return -EOPNOTSUPP; }
+static inline bool domblockdev_zoned_unclaim(domblockdev_device_t* dev, struct request *rq) { return false; }
+static inline int domblockdev_zoned_mgmt(domblockdev_device_t* dev, struct request *rq) { return -EOPNOTSUPP; }
+static inline void domblockdev_zoned_reset_all(domblockdev_queue_t *q, struct request *rq) { } // dev->zoned is never set
+#endif
+
+#endif /* _DOMBLOCKDEV_H */
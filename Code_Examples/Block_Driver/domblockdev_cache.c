@@ -0,0 +1,613 @@
+// Write-back cache mode for the domblockdev ramdisk
+// With cache_file set, the disk is as big as that file and the backing pages only cache it:
+//   insmod domsblockdev.ko cache_file=/data/big.img cache_size=2G
+// Reads that hit a cached page are served from memory, misses read the page from the file
+// first. Writes only dirty the cached page. A background worker writes dirty pages back
+// every cache_flush_ms, oldest first, in batches of up to DOMBLOCKDEV_CACHE_BATCH pages that
+// are sorted by offset so that neighbouring pages go out in one write. REQ_OP_FLUSH writes
+// back everything that is dirty and fsyncs the file, so the disk advertises a volatile
+// write cache and the usual flush and FUA rules keep filesystems on it safe.
+//
+// Clean pages sit on an LRU list and are evicted from its head once cache_size is reached.
+// Dirty pages sit on their own list in the order they were first dirtied and can't be evicted
+// until they have been written back. If the cache is full of dirty pages, the submitter writes
+// a batch back itself.
+//
+// Reading the file sleeps, so in this mode the tag set is BLK_MQ_F_BLOCKING. The index, both
+// lists and the reference counts are protected by the xarray's own lock. Page data is copied
+// and written to the file without it, while a reference keeps the entry alive.
+
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/uio.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/sort.h>
+#include <linux/wait_bit.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/errseq.h>
+#include <linux/percpu.h>
+#include <linux/device.h>
+#include <linux/genhd.h>
+#include <linux/math64.h>
+#include <linux/moduleparam.h>
+
+#include "domblockdev.h"
+
+#define DOMBLOCKDEV_CACHE_BATCH		1024	// pages per writeback batch, 4 MB with 4k pages
+#define DOMBLOCKDEV_CACHE_SCAN		64	// how far down the LRU to look for an unused page
+
+static char *cache_file = "";
+module_param(cache_file, charp, S_IRUGO);
+MODULE_PARM_DESC(cache_file, "Cache this file instead of being a plain ramdisk, %d is replaced by the disk number (empty = off)");
+
+static char *cache_size = "256M";
+module_param(cache_size, charp, S_IRUGO);
+MODULE_PARM_DESC(cache_size, "Memory for cached pages, with optional K/M/G suffix");
+
+static unsigned int cache_flush_ms = 1000;
+module_param(cache_flush_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(cache_flush_ms, "Write dirty pages back at this interval in milliseconds");
+
+static bool _cache_file_taken = false;	// a path without %d can only back one disk, under the add/remove lock
+
+enum {
+	DOMBLOCKDEV_CENTRY_LOADING,	// being read from the file or written for the first time, wait for it
+	DOMBLOCKDEV_CENTRY_DIRTY,
+	DOMBLOCKDEV_CENTRY_ERROR,	// the read failed, the entry is not in the index any more
+};
+
+typedef struct domblockdev_centry_s {
+	struct list_head lru;		// On the clean LRU or the dirty list
+	pgoff_t idx;
+	struct page *page;
+	unsigned int refs;		// Requests and writeback using the entry
+	unsigned long flags;
+} domblockdev_centry_t;
+
+typedef struct domblockdev_cache_stats_s {
+	u64 hits;
+	u64 misses;
+	u64 evictions;
+	u64 flushed_pages;
+	u64 flush_batches;
+	u64 flush_writes;		// vfs writes, each one covers a run of neighbouring pages
+} domblockdev_cache_stats_t;
+
+struct domblockdev_cache_s {
+	domblockdev_device_t *dev;
+	struct file *file;
+	bool own_path;			// Clears _cache_file_taken when the cache goes away
+	unsigned long max_entries;
+	unsigned long nr_entries;	// Under the xa_lock
+	unsigned long nr_dirty;		// Under the xa_lock
+	struct list_head clean;		// Least recently used first
+	struct list_head dirty;		// Dirtied first first
+	struct mutex flush_lock;	// One writeback at a time, also guards batch and bvec
+	errseq_t wb_err;		// Failed writebacks, so a flush learns of those it didn't do itself
+	domblockdev_centry_t **batch;
+	struct bio_vec *bvec;
+	struct delayed_work flush_work;
+	domblockdev_cache_stats_t __percpu *stats;
+};
+
+static int domblockdev_cache_io(domblockdev_cache_t *c, struct bio_vec *bvec, unsigned int nr, loff_t pos, bool write) {
+	struct iov_iter iter;
+	ssize_t done;
+
+	iov_iter_bvec(&iter, write ? WRITE : READ, bvec, nr, nr << PAGE_SHIFT);
+	done = write ? vfs_iter_write(c->file, &iter, &pos, 0) : vfs_iter_read(c->file, &iter, &pos, 0);
+	if (done != (ssize_t)nr << PAGE_SHIFT)
+		return done < 0 ? done : -EIO;
+	return 0;
+}
+
+static void domblockdev_centry_free(domblockdev_centry_t *e) {
+	__free_page(e->page);
+	kfree(e);
+}
+
+static void domblockdev_cache_put(domblockdev_cache_t *c, domblockdev_centry_t *e) {
+	struct xarray *xa = &c->dev->pages;
+	bool gone;
+
+	xa_lock(xa);
+	gone = --e->refs == 0 && test_bit(DOMBLOCKDEV_CENTRY_ERROR, &e->flags);
+	xa_unlock(xa);
+
+	if (gone)
+		domblockdev_centry_free(e);
+}
+
+// Called with the xa_lock held
+static void domblockdev_cache_mark_dirty(domblockdev_cache_t *c, domblockdev_centry_t *e) {
+	if (!test_and_set_bit(DOMBLOCKDEV_CENTRY_DIRTY, &e->flags)) {
+		list_move_tail(&e->lru, &c->dirty);
+		c->nr_dirty++;
+	}
+}
+
+static int domblockdev_centry_cmp(const void *a, const void *b) {
+	pgoff_t x = (*(domblockdev_centry_t * const *)a)->idx;
+	pgoff_t y = (*(domblockdev_centry_t * const *)b)->idx;
+
+	return x < y ? -1 : x > y;
+}
+
+// Write back up to max (at most DOMBLOCKDEV_CACHE_BATCH) of the oldest dirty pages. Returns how many were written.
+static int domblockdev_cache_writeback(domblockdev_cache_t *c, unsigned long max) {
+	struct xarray *xa = &c->dev->pages;
+	unsigned int nr = 0, i, j, k;
+	int ret, err = 0;
+
+	mutex_lock(&c->flush_lock);
+
+	// The entries are clean from here on. A write that lands while we copy them out dirties them again.
+	xa_lock(xa);
+	while (nr < DOMBLOCKDEV_CACHE_BATCH && nr < max && !list_empty(&c->dirty)) {
+		domblockdev_centry_t *e = list_first_entry(&c->dirty, domblockdev_centry_t, lru);
+
+		clear_bit(DOMBLOCKDEV_CENTRY_DIRTY, &e->flags);
+		list_move_tail(&e->lru, &c->clean);
+		c->nr_dirty--;
+		e->refs++;
+		c->batch[nr++] = e;
+	}
+	xa_unlock(xa);
+
+	sort(c->batch, nr, sizeof(*c->batch), domblockdev_centry_cmp, NULL);
+
+	for (i = 0; i < nr; i = j) {
+		for (j = i + 1; j < nr && c->batch[j]->idx == c->batch[j - 1]->idx + 1; j++)
+			;
+		for (k = i; k < j; k++) {
+			c->bvec[k - i].bv_page = c->batch[k]->page;
+			c->bvec[k - i].bv_offset = 0;
+			c->bvec[k - i].bv_len = PAGE_SIZE;
+		}
+
+		ret = domblockdev_cache_io(c, c->bvec, j - i, (loff_t)c->batch[i]->idx << PAGE_SHIFT, true);
+		if (ret) {
+			printk_ratelimited(KERN_WARNING "domblockdev: Writeback to the cache file failed (%d)\n", ret);
+			errseq_set(&c->wb_err, ret);
+			err = ret;
+			xa_lock(xa);
+			for (k = i; k < j; k++)
+				domblockdev_cache_mark_dirty(c, c->batch[k]);
+			xa_unlock(xa);
+			continue;
+		}
+		this_cpu_add(c->stats->flushed_pages, j - i);
+		this_cpu_inc(c->stats->flush_writes);
+	}
+	if (nr)
+		this_cpu_inc(c->stats->flush_batches);
+
+	for (i = 0; i < nr; i++)
+		domblockdev_cache_put(c, c->batch[i]);
+
+	mutex_unlock(&c->flush_lock);
+	return err ? err : nr;
+}
+
+// Write back what is dirty right now. Pages dirtied meanwhile go to the end of the dirty list
+// and are left for next time, so under a steady stream of writes this still ends. Returns 0 or
+// the last error of its own writes. Pages that another writeback took and failed to write go
+// back to the end of the list too and may be missed here, domblockdev_cache_flush finds out
+// about them from wb_err.
+static int domblockdev_cache_writeback_all(domblockdev_cache_t *c) {
+	unsigned long left = READ_ONCE(c->nr_dirty);
+	int ret;
+
+	// At least one round, even with nothing dirty: taking flush_lock waits for a writeback that
+	// is under way, its pages are off the dirty list already but were dirty before we started
+	do {
+		ret = domblockdev_cache_writeback(c, left);
+		if (ret < 0)
+			return ret;
+		left -= min_t(unsigned long, ret, left);
+		cond_resched();
+	} while (left && ret);
+	return 0;
+}
+
+static void domblockdev_cache_flush_work(struct work_struct *work) {
+	domblockdev_cache_t *c = container_of(to_delayed_work(work), domblockdev_cache_t, flush_work);
+
+	domblockdev_cache_writeback_all(c);
+	queue_delayed_work(system_unbound_wq, &c->flush_work, msecs_to_jiffies(max(READ_ONCE(cache_flush_ms), 1U)));
+}
+
+// Drop the least recently used clean page nobody is using, once the cache is full
+static void domblockdev_cache_make_room(domblockdev_cache_t *c) {
+	struct xarray *xa = &c->dev->pages;
+
+	for (;;) {
+		domblockdev_centry_t *e, *victim = NULL;
+		int scanned = 0;
+
+		xa_lock(xa);
+		if (c->nr_entries < c->max_entries) {
+			xa_unlock(xa);
+			return;
+		}
+		list_for_each_entry(e, &c->clean, lru) {
+			if (e->refs == 0) {
+				victim = e;
+				break;
+			}
+			if (++scanned == DOMBLOCKDEV_CACHE_SCAN)
+				break;
+		}
+		if (victim) {
+			__xa_erase(xa, victim->idx);
+			list_del(&victim->lru);
+			c->nr_entries--;
+		}
+		xa_unlock(xa);
+
+		if (victim) {
+			atomic_long_dec(&c->dev->nr_pages);
+			this_cpu_inc(c->stats->evictions);
+			domblockdev_centry_free(victim);
+			return;
+		}
+
+		// Everything is dirty or busy. Clean some pages ourselves, and if there is nothing
+		// to write back either, the requests in flight hold the cache and we go over for now.
+		if (domblockdev_cache_writeback(c, DOMBLOCKDEV_CACHE_BATCH) <= 0)
+			return;
+	}
+}
+
+// Find the entry for page idx, or add it, and take a reference. The entry returned has its
+// data unless whole is set (the caller overwrites the full page). Then it comes back still
+// marked loading and the caller must call domblockdev_cache_loaded once the data is in.
+static domblockdev_centry_t *domblockdev_cache_get(domblockdev_cache_t *c, pgoff_t idx, bool whole) {
+	struct xarray *xa = &c->dev->pages;
+	domblockdev_centry_t *e, *fresh = NULL;
+	int ret;
+
+	for (;;) {
+		xa_lock(xa);
+		e = xa_load(xa, idx);
+		if (e) {
+			e->refs++;
+			if (!test_bit(DOMBLOCKDEV_CENTRY_DIRTY, &e->flags))
+				list_move_tail(&e->lru, &c->clean);
+			xa_unlock(xa);
+
+			if (fresh)
+				domblockdev_centry_free(fresh); // somebody else added it first
+			else
+				this_cpu_inc(c->stats->hits);
+
+			wait_on_bit(&e->flags, DOMBLOCKDEV_CENTRY_LOADING, TASK_UNINTERRUPTIBLE);
+			if (test_bit(DOMBLOCKDEV_CENTRY_ERROR, &e->flags)) {
+				domblockdev_cache_put(c, e);
+				return ERR_PTR(-EIO);
+			}
+			return e;
+		}
+
+		if (fresh)
+			break;
+		xa_unlock(xa);
+
+		// A miss. GFP_NOIO, the memory we need may be tied up in writes queued to us.
+		this_cpu_inc(c->stats->misses);
+		domblockdev_cache_make_room(c);
+		fresh = kzalloc(sizeof(*fresh), GFP_NOIO);
+		if (fresh)
+			fresh->page = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+		if (fresh == NULL || fresh->page == NULL) {
+			kfree(fresh);
+			return ERR_PTR(-ENOMEM);
+		}
+		fresh->idx = idx;
+		fresh->refs = 1;
+		__set_bit(DOMBLOCKDEV_CENTRY_LOADING, &fresh->flags);
+	}
+
+	// Still under the xa_lock, which __xa_insert may drop to allocate
+	ret = __xa_insert(xa, idx, fresh, GFP_NOIO);
+	if (ret == 0) {
+		list_add_tail(&fresh->lru, &c->clean);
+		c->nr_entries++;
+	}
+	xa_unlock(xa);
+
+	if (ret) {
+		domblockdev_centry_free(fresh);
+		if (ret == -EBUSY) // added by somebody else while the lock was dropped, go again
+			return domblockdev_cache_get(c, idx, whole);
+		return ERR_PTR(ret);
+	}
+	atomic_long_inc(&c->dev->nr_pages);
+
+	if (!whole) {
+		struct bio_vec bvec = { .bv_page = fresh->page, .bv_offset = 0, .bv_len = PAGE_SIZE };
+
+		ret = domblockdev_cache_io(c, &bvec, 1, (loff_t)idx << PAGE_SHIFT, false);
+		if (ret) {
+			xa_lock(xa);
+			__xa_erase(xa, idx);
+			list_del(&fresh->lru);
+			c->nr_entries--;
+			set_bit(DOMBLOCKDEV_CENTRY_ERROR, &fresh->flags);
+			xa_unlock(xa);
+			atomic_long_dec(&c->dev->nr_pages);
+		}
+		clear_bit_unlock(DOMBLOCKDEV_CENTRY_LOADING, &fresh->flags);
+		smp_mb__after_atomic();
+		wake_up_bit(&fresh->flags, DOMBLOCKDEV_CENTRY_LOADING);
+		if (ret) {
+			domblockdev_cache_put(c, fresh);
+			return ERR_PTR(ret);
+		}
+	}
+
+	return fresh;
+}
+
+static void domblockdev_cache_loaded(domblockdev_centry_t *e) {
+	if (test_bit(DOMBLOCKDEV_CENTRY_LOADING, &e->flags)) {
+		clear_bit_unlock(DOMBLOCKDEV_CENTRY_LOADING, &e->flags);
+		smp_mb__after_atomic();
+		wake_up_bit(&e->flags, DOMBLOCKDEV_CENTRY_LOADING);
+	}
+}
+
+int domblockdev_cache_write(domblockdev_device_t* dev, sector_t sector, struct page *page, unsigned int offset, unsigned int len) {
+	domblockdev_cache_t *c = dev->cache;
+
+	while (len) {
+		pgoff_t idx = sector >> DOMBLOCKDEV_PAGE_SECTORS_SHIFT;
+		unsigned int pg_off = (sector & (DOMBLOCKDEV_PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+		unsigned int chunk = min_t(unsigned int, len, PAGE_SIZE - pg_off);
+		domblockdev_centry_t *e = domblockdev_cache_get(c, idx, chunk == PAGE_SIZE);
+		void *src, *dst;
+
+		if (IS_ERR(e))
+			return PTR_ERR(e);
+
+		src = kmap_atomic(page);
+		dst = kmap_atomic(e->page);
+		memcpy(dst + pg_off, src + offset, chunk);
+		kunmap_atomic(dst);
+		kunmap_atomic(src);
+		domblockdev_cache_loaded(e);
+
+		xa_lock(&dev->pages);
+		domblockdev_cache_mark_dirty(c, e);
+		xa_unlock(&dev->pages);
+		domblockdev_cache_put(c, e);
+
+		sector += chunk >> SECTOR_SHIFT;
+		offset += chunk;
+		len -= chunk;
+	}
+
+	// Past half the cache dirty, don't wait for the next tick
+	if (READ_ONCE(c->nr_dirty) > c->max_entries / 2)
+		mod_delayed_work(system_unbound_wq, &c->flush_work, 0);
+
+	return 0;
+}
+
+int domblockdev_cache_read(domblockdev_device_t* dev, sector_t sector, struct page *page, unsigned int offset, unsigned int len) {
+	domblockdev_cache_t *c = dev->cache;
+
+	while (len) {
+		pgoff_t idx = sector >> DOMBLOCKDEV_PAGE_SECTORS_SHIFT;
+		unsigned int pg_off = (sector & (DOMBLOCKDEV_PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+		unsigned int chunk = min_t(unsigned int, len, PAGE_SIZE - pg_off);
+		domblockdev_centry_t *e = domblockdev_cache_get(c, idx, false);
+		void *src, *dst;
+
+		if (IS_ERR(e))
+			return PTR_ERR(e);
+
+		src = kmap_atomic(e->page);
+		dst = kmap_atomic(page);
+		memcpy(dst + offset, src + pg_off, chunk);
+		kunmap_atomic(dst);
+		kunmap_atomic(src);
+		domblockdev_cache_put(c, e);
+
+		sector += chunk >> SECTOR_SHIFT;
+		offset += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+// REQ_OP_FLUSH: every write that has completed so far is dirty in the cache or already
+// written back, so writing back the pages that are dirty now and syncing the file makes them
+// durable. Writes that complete later aren't covered by this flush and don't hold it up.
+// REQ_OP_FLUSH. Fails if any writeback failed since the last flush that reported an error, ours
+// or the worker's, the same way fsync reports writeback errors.
+int domblockdev_cache_flush(domblockdev_device_t* dev) {
+	domblockdev_cache_t *c = dev->cache;
+	errseq_t since = errseq_sample(&c->wb_err);
+	int ret, err;
+
+	ret = domblockdev_cache_writeback_all(c);
+	if (ret == 0)
+		ret = vfs_fsync(c->file, 0);
+	err = errseq_check_and_advance(&c->wb_err, &since);
+	return ret ? ret : err;
+}
+
+// The path for this disk, with a %d in cache_file replaced by its number
+static char *domblockdev_cache_path(domblockdev_device_t* dev, bool *own_path) {
+	char *pct = strstr(cache_file, "%d");
+
+	*own_path = pct == NULL;
+	if (pct == NULL)
+		return kstrdup(cache_file, GFP_KERNEL);
+	return kasprintf(GFP_KERNEL, "%.*s%d%s", (int)(pct - cache_file), cache_file, dev->index, pct + 2);
+}
+
+int domblockdev_cache_init(domblockdev_device_t* dev) {
+	unsigned long long bytes;
+	domblockdev_cache_t *c;
+	char *path;
+	loff_t size;
+	int ret = -ENOMEM;
+
+	if (cache_file == NULL || *cache_file == '\0')
+		return 0;
+
+	bytes = memparse(cache_size, NULL);
+	if (bytes < PAGE_SIZE * DOMBLOCKDEV_CACHE_BATCH) {
+		printk(KERN_WARNING "domblockdev: cache_size must be at least %lu bytes\n", PAGE_SIZE * DOMBLOCKDEV_CACHE_BATCH);
+		return -EINVAL;
+	}
+
+	c = kzalloc(sizeof(*c), GFP_KERNEL);
+	if (c == NULL)
+		return -ENOMEM;
+	c->dev = dev;
+	c->max_entries = bytes >> PAGE_SHIFT;
+	INIT_LIST_HEAD(&c->clean);
+	INIT_LIST_HEAD(&c->dirty);
+	mutex_init(&c->flush_lock);
+	INIT_DELAYED_WORK(&c->flush_work, domblockdev_cache_flush_work);
+
+	c->batch = kvmalloc_array(DOMBLOCKDEV_CACHE_BATCH, sizeof(*c->batch), GFP_KERNEL);
+	c->bvec = kvmalloc_array(DOMBLOCKDEV_CACHE_BATCH, sizeof(*c->bvec), GFP_KERNEL);
+	c->stats = alloc_percpu(domblockdev_cache_stats_t);
+	path = domblockdev_cache_path(dev, &c->own_path);
+	if (c->batch == NULL || c->bvec == NULL || c->stats == NULL || path == NULL)
+		goto fail;
+
+	if (c->own_path && _cache_file_taken) {
+		printk(KERN_WARNING "domblockdev: %s already backs a disk, put %%d in cache_file for more than one\n", path);
+		ret = -EBUSY;
+		goto fail;
+	}
+
+	// Page sized and aligned I/O only, so O_DIRECT keeps the file out of the page cache
+	c->file = filp_open(path, O_RDWR | O_LARGEFILE | O_DIRECT, 0);
+	if (IS_ERR(c->file) && PTR_ERR(c->file) == -EINVAL)
+		c->file = filp_open(path, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(c->file)) {
+		ret = PTR_ERR(c->file);
+		c->file = NULL;
+		printk(KERN_WARNING "domblockdev: Can't open cache file %s (%d)\n", path, ret);
+		goto fail;
+	}
+
+	// The disk is as big as the file, whatever capacity says
+	size = round_down(i_size_read(file_inode(c->file)), PAGE_SIZE);
+	if (size == 0) {
+		printk(KERN_WARNING "domblockdev: Cache file %s is smaller than a page\n", path);
+		ret = -EINVAL;
+		goto fail;
+	}
+	dev->capacity = size >> SECTOR_SHIFT;
+
+	if (c->own_path)
+		_cache_file_taken = true;
+	kfree(path);
+	dev->cache = c;
+	queue_delayed_work(system_unbound_wq, &c->flush_work, msecs_to_jiffies(max(cache_flush_ms, 1U)));
+	return 0;
+
+fail:
+	if (c->file)
+		filp_close(c->file, NULL);
+	kfree(path);
+	free_percpu(c->stats);
+	kvfree(c->bvec);
+	kvfree(c->batch);
+	kfree(c);
+	return ret;
+}
+
+// Write everything back and let go of the file. The queue is gone by now, nothing else uses the cache.
+void domblockdev_cache_free(domblockdev_device_t* dev) {
+	domblockdev_cache_t *c = dev->cache;
+	domblockdev_centry_t *e, *next;
+	int ret;
+
+	if (c == NULL)
+		return;
+
+	cancel_delayed_work_sync(&c->flush_work);
+	ret = domblockdev_cache_flush(dev);
+	if (ret)
+		printk(KERN_WARNING "domblockdev: Lost dirty cache pages on removal (%d)\n", ret);
+
+	xa_destroy(&dev->pages);
+	list_splice_init(&c->dirty, &c->clean);
+	list_for_each_entry_safe(e, next, &c->clean, lru) {
+		domblockdev_centry_free(e);
+		cond_resched();
+	}
+
+	filp_close(c->file, NULL);
+	if (c->own_path)
+		_cache_file_taken = false;
+	free_percpu(c->stats);
+	kvfree(c->bvec);
+	kvfree(c->batch);
+	kfree(c);
+	dev->cache = NULL;
+}
+
+// /sys/block/<disk>/cache_stats
+static ssize_t cache_stats_show(struct device *d, struct device_attribute *attr, char *buf) {
+	domblockdev_device_t* dev = dev_to_disk(d)->private_data;
+	domblockdev_cache_t *c = dev->cache;
+	domblockdev_cache_stats_t sum = {};
+	unsigned long entries, dirty;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		domblockdev_cache_stats_t *stats = per_cpu_ptr(c->stats, cpu);
+
+		sum.hits += stats->hits;
+		sum.misses += stats->misses;
+		sum.evictions += stats->evictions;
+		sum.flushed_pages += stats->flushed_pages;
+		sum.flush_batches += stats->flush_batches;
+		sum.flush_writes += stats->flush_writes;
+	}
+	xa_lock(&dev->pages);
+	entries = c->nr_entries;
+	dirty = c->nr_dirty;
+	xa_unlock(&dev->pages);
+
+	return scnprintf(buf, PAGE_SIZE,
+			 "cache_bytes     %llu\n"
+			 "cached_bytes    %llu\n"
+			 "dirty_bytes     %llu\n"
+			 "hits            %llu\n"
+			 "misses          %llu\n"
+			 "hit_ratio_x100  %llu\n"
+			 "evictions       %llu\n"
+			 "flushed_bytes   %llu\n"
+			 "flush_batches   %llu\n"
+			 "flush_writes    %llu\n",
+			 (u64)c->max_entries << PAGE_SHIFT, (u64)entries << PAGE_SHIFT, (u64)dirty << PAGE_SHIFT,
+			 sum.hits, sum.misses,
+			 sum.hits + sum.misses ? div64_u64(sum.hits * 100, sum.hits + sum.misses) : 0,
+			 sum.evictions, sum.flushed_pages << PAGE_SHIFT, sum.flush_batches, sum.flush_writes);
+}
+static DEVICE_ATTR_RO(cache_stats);
+
+int domblockdev_cache_sysfs_init(domblockdev_device_t* dev) {
+	if (dev->cache == NULL)
+		return 0;
+	return device_create_file(disk_to_dev(dev->disk), &dev_attr_cache_stats);
+}
+
+void domblockdev_cache_sysfs_exit(domblockdev_device_t* dev) {
+	if (dev->cache)
+		device_remove_file(disk_to_dev(dev->disk), &dev_attr_cache_stats);
+}
@@ -0,0 +1,434 @@
+// Compressed page store for the domblockdev ramdisk, in the spirit of zram
+// With compression=<algorithm> (lz4 for example) the xarray no longer holds plain pages.
+// Every 4k page is compressed with the kernel crypto API and kept in a zsmalloc pool:
+//   - a page of zeros is not stored at all and reads back as zeros like any unwritten page
+//   - a page filled with one repeated word is kept as just that word
+//   - a page that does not compress below 3/4 of its size is kept raw
+// Partial page writes read, merge and recompress the page. Each page is protected by one of
+// DOMBLOCKDEV_COMP_LOCKS spinlocks chosen by page index, so different queues hardly ever
+// meet on the same lock, and the per-CPU compression streams are only used under it.
+// Statistics live in per-CPU counters and show up in /sys/block/<disk>/comp_stats.
+
+#include <linux/crypto.h>
+#include <linux/zsmalloc.h>
+#include <linux/highmem.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/sched/clock.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/device.h>
+#include <linux/genhd.h>
+#include <linux/math64.h>
+
+#include "domblockdev.h"
+
+#define DOMBLOCKDEV_COMP_LOCKS		256
+#define DOMBLOCKDEV_COMP_HUGE		(PAGE_SIZE * 3 / 4)	// store raw at or above this size
+
+// What the xarray points to for each stored page
+typedef struct domblockdev_zpage_s {
+	unsigned long handle;		// zsmalloc handle, 0 for a same-filled page
+	unsigned long fill;		// The repeated word of a same-filled page
+	unsigned int len;		// Compressed length, PAGE_SIZE when stored raw
+} domblockdev_zpage_t;
+
+// One compression stream per CPU, only touched with the page lock held (so preemption is off)
+typedef struct domblockdev_comp_stream_s {
+	struct crypto_comp *tfm;
+	u8 *buffer;			// 2 pages, compression output can be larger than the input
+	u8 *merge;			// 1 page, for read-modify-write of partial pages
+} domblockdev_comp_stream_t;
+
+typedef struct domblockdev_comp_stats_s {
+	s64 compr_bytes;		// Compressed bytes held in the pool
+	s64 same_pages;
+	s64 huge_pages;			// Pages kept raw
+	u64 comp_ops;
+	u64 comp_ns;
+	u64 decomp_ops;
+	u64 decomp_ns;
+} domblockdev_comp_stats_t;
+
+struct domblockdev_comp_s {
+	struct zs_pool *pool;
+	domblockdev_comp_stream_t __percpu *streams;
+	domblockdev_comp_stats_t __percpu *stats;
+	char algorithm[CRYPTO_MAX_ALG_NAME];
+	char pool_name[32];		// domblockdev-N, every disk's pool needs its own debugfs and cache names
+	struct {
+		spinlock_t lock;
+	} ____cacheline_aligned_in_smp locks[DOMBLOCKDEV_COMP_LOCKS];
+};
+
+static spinlock_t *domblockdev_comp_lock(domblockdev_comp_t *comp, pgoff_t idx) {
+	return &comp->locks[idx & (DOMBLOCKDEV_COMP_LOCKS - 1)].lock;
+}
+
+static void domblockdev_comp_free_entry(domblockdev_comp_t *comp, domblockdev_zpage_t *zp) {
+	domblockdev_comp_stats_t *stats = this_cpu_ptr(comp->stats);
+
+	if (zp->handle == 0)
+		stats->same_pages--;
+	else {
+		zs_free(comp->pool, zp->handle);
+		stats->compr_bytes -= zp->len;
+		if (zp->len == PAGE_SIZE)
+			stats->huge_pages--;
+	}
+	kfree(zp);
+}
+
+// Unpack a stored page into buf, which is PAGE_SIZE bytes. Called with the page lock held.
+static int domblockdev_comp_unpack(domblockdev_comp_t *comp, domblockdev_zpage_t *zp, u8 *buf) {
+	domblockdev_comp_stream_t *stream = this_cpu_ptr(comp->streams);
+	domblockdev_comp_stats_t *stats = this_cpu_ptr(comp->stats);
+	unsigned int dlen = PAGE_SIZE;
+	int ret = 0;
+	u64 start;
+	void *src;
+
+	if (zp == NULL) {
+		memset(buf, 0, PAGE_SIZE);
+		return 0;
+	}
+	if (zp->handle == 0) {
+		memset_l((unsigned long *)buf, zp->fill, PAGE_SIZE / sizeof(unsigned long));
+		return 0;
+	}
+
+	src = zs_map_object(comp->pool, zp->handle, ZS_MM_RO);
+	if (zp->len == PAGE_SIZE)
+		memcpy(buf, src, PAGE_SIZE);
+	else {
+		start = local_clock();
+		ret = crypto_comp_decompress(stream->tfm, src, zp->len, buf, &dlen);
+		stats->decomp_ns += local_clock() - start;
+		stats->decomp_ops++;
+	}
+	zs_unmap_object(comp->pool, zp->handle);
+
+	return ret;
+}
+
+static bool domblockdev_comp_same_filled(const u8 *data, unsigned long *fill) {
+	const unsigned long *word = (const unsigned long *)data;
+	unsigned int i;
+
+	for (i = 1; i < PAGE_SIZE / sizeof(unsigned long); i++)
+		if (word[i] != word[0])
+			return false;
+	*fill = word[0];
+	return true;
+}
+
+// Compress a full page of data and put it at idx, replacing the old entry.
+// Called with the page lock held.
+static int domblockdev_comp_pack(domblockdev_device_t* dev, pgoff_t idx, const u8 *data) {
+	domblockdev_comp_t *comp = dev->comp;
+	domblockdev_comp_stream_t *stream = this_cpu_ptr(comp->streams);
+	domblockdev_comp_stats_t *stats = this_cpu_ptr(comp->stats);
+	domblockdev_zpage_t *zp = NULL, *old;
+	unsigned int len = 2 * PAGE_SIZE;
+	unsigned long fill;
+	const u8 *src = data;
+	u64 start;
+	void *dst;
+
+	if (domblockdev_comp_same_filled(data, &fill)) {
+		if (fill != 0) {
+			zp = kzalloc(sizeof(*zp), GFP_NOWAIT | __GFP_NOWARN);
+			if (zp == NULL)
+				return -ENOMEM;
+			zp->fill = fill;
+			stats->same_pages++;
+		}
+		// a page of zeros simply has no entry
+	}
+	else {
+		start = local_clock();
+		if (crypto_comp_compress(stream->tfm, data, PAGE_SIZE, stream->buffer, &len) || len >= DOMBLOCKDEV_COMP_HUGE)
+			len = PAGE_SIZE;
+		else
+			src = stream->buffer;
+		stats->comp_ns += local_clock() - start;
+		stats->comp_ops++;
+
+		zp = kzalloc(sizeof(*zp), GFP_NOWAIT | __GFP_NOWARN);
+		if (zp == NULL)
+			return -ENOMEM;
+		zp->handle = zs_malloc(comp->pool, len, GFP_NOWAIT | __GFP_NOWARN | __GFP_HIGHMEM | __GFP_MOVABLE);
+		if (zp->handle == 0) {
+			kfree(zp);
+			return -ENOMEM;
+		}
+		zp->len = len;
+
+		dst = zs_map_object(comp->pool, zp->handle, ZS_MM_WO);
+		memcpy(dst, src, len);
+		zs_unmap_object(comp->pool, zp->handle);
+
+		stats->compr_bytes += len;
+		if (len == PAGE_SIZE)
+			stats->huge_pages++;
+	}
+
+	if (zp)
+		old = xa_store(&dev->pages, idx, zp, GFP_NOWAIT | __GFP_NOWARN);
+	else
+		old = xa_erase(&dev->pages, idx);
+	if (xa_is_err(old)) {
+		domblockdev_comp_free_entry(comp, zp);
+		return xa_err(old);
+	}
+
+	if (zp && old == NULL)
+		atomic_long_inc(&dev->nr_pages);
+	else if (zp == NULL && old)
+		atomic_long_dec(&dev->nr_pages);
+	if (old)
+		domblockdev_comp_free_entry(comp, old);
+
+	return 0;
+}
+
+int domblockdev_comp_write(domblockdev_device_t* dev, sector_t sector, struct page *page, unsigned int offset, unsigned int len) {
+	domblockdev_comp_t *comp = dev->comp;
+	int ret = 0;
+
+	while (len && ret == 0) {
+		pgoff_t idx = sector >> DOMBLOCKDEV_PAGE_SECTORS_SHIFT;
+		unsigned int pg_off = (sector & (DOMBLOCKDEV_PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+		unsigned int chunk = min_t(unsigned int, len, PAGE_SIZE - pg_off);
+		spinlock_t *lock = domblockdev_comp_lock(comp, idx);
+		u8 *src;
+
+		spin_lock(lock);
+		src = kmap_atomic(page);
+		if (chunk == PAGE_SIZE)
+			ret = domblockdev_comp_pack(dev, idx, src + offset);
+		else {
+			u8 *merge = this_cpu_ptr(comp->streams)->merge;
+
+			ret = domblockdev_comp_unpack(comp, xa_load(&dev->pages, idx), merge);
+			if (ret == 0) {
+				memcpy(merge + pg_off, src + offset, chunk);
+				ret = domblockdev_comp_pack(dev, idx, merge);
+			}
+		}
+		kunmap_atomic(src);
+		spin_unlock(lock);
+
+		sector += chunk >> SECTOR_SHIFT;
+		offset += chunk;
+		len -= chunk;
+	}
+
+	return ret;
+}
+
+int domblockdev_comp_read(domblockdev_device_t* dev, sector_t sector, struct page *page, unsigned int offset, unsigned int len) {
+	domblockdev_comp_t *comp = dev->comp;
+	int ret = 0;
+
+	while (len && ret == 0) {
+		pgoff_t idx = sector >> DOMBLOCKDEV_PAGE_SECTORS_SHIFT;
+		unsigned int pg_off = (sector & (DOMBLOCKDEV_PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+		unsigned int chunk = min_t(unsigned int, len, PAGE_SIZE - pg_off);
+		spinlock_t *lock = domblockdev_comp_lock(comp, idx);
+		u8 *dst;
+
+		spin_lock(lock);
+		dst = kmap_atomic(page);
+		if (chunk == PAGE_SIZE)
+			ret = domblockdev_comp_unpack(comp, xa_load(&dev->pages, idx), dst + offset);
+		else {
+			u8 *merge = this_cpu_ptr(comp->streams)->merge;
+
+			ret = domblockdev_comp_unpack(comp, xa_load(&dev->pages, idx), merge);
+			memcpy(dst + offset, merge + pg_off, chunk);
+		}
+		kunmap_atomic(dst);
+		spin_unlock(lock);
+
+		sector += chunk >> SECTOR_SHIFT;
+		offset += chunk;
+		len -= chunk;
+	}
+
+	return ret;
+}
+
+// Clear sectors [pg_sect, pg_sect + nr) of the page at idx, dropping the entry when that is the whole page
+static int domblockdev_comp_zero_page(domblockdev_device_t* dev, pgoff_t idx, unsigned int pg_sect, unsigned int nr) {
+	domblockdev_comp_t *comp = dev->comp;
+	spinlock_t *lock = domblockdev_comp_lock(comp, idx);
+	domblockdev_zpage_t *zp;
+	int ret = 0;
+
+	spin_lock(lock);
+	zp = xa_load(&dev->pages, idx);
+	if (zp && nr == DOMBLOCKDEV_PAGE_SECTORS) {
+		xa_erase(&dev->pages, idx);
+		atomic_long_dec(&dev->nr_pages);
+		domblockdev_comp_free_entry(comp, zp);
+	}
+	else if (zp) {
+		u8 *merge = this_cpu_ptr(comp->streams)->merge;
+
+		ret = domblockdev_comp_unpack(comp, zp, merge);
+		if (ret == 0) {
+			memset(merge + (pg_sect << SECTOR_SHIFT), 0, nr << SECTOR_SHIFT);
+			ret = domblockdev_comp_pack(dev, idx, merge);
+		}
+	}
+	spin_unlock(lock);
+
+	return ret;
+}
+
+// Discard and write-zeroes
+int domblockdev_comp_zero(domblockdev_device_t* dev, sector_t sector, sector_t nr_sects) {
+	return domblockdev_store_zero_pages(dev, sector, nr_sects, domblockdev_comp_zero_page);
+}
+
+static void domblockdev_comp_free_streams(domblockdev_comp_t *comp) {
+	int cpu;
+
+	if (comp->streams == NULL)
+		return;
+	for_each_possible_cpu(cpu) {
+		domblockdev_comp_stream_t *stream = per_cpu_ptr(comp->streams, cpu);
+
+		if (!IS_ERR_OR_NULL(stream->tfm))
+			crypto_free_comp(stream->tfm);
+		kfree(stream->buffer);
+		kfree(stream->merge);
+	}
+	free_percpu(comp->streams);
+}
+
+int domblockdev_comp_init(domblockdev_device_t* dev, const char *algorithm) {
+	domblockdev_comp_t *comp;
+	int cpu, ret = 0;
+
+	if (!crypto_has_comp(algorithm, 0, 0)) {
+		printk(KERN_WARNING "domblockdev: Compression algorithm %s is not available\n", algorithm);
+		return -ENOENT;
+	}
+
+	comp = kzalloc(sizeof(*comp), GFP_KERNEL);
+	if (comp == NULL)
+		return -ENOMEM;
+	strscpy(comp->algorithm, algorithm, sizeof(comp->algorithm));
+	for (cpu = 0; cpu < DOMBLOCKDEV_COMP_LOCKS; cpu++)
+		spin_lock_init(&comp->locks[cpu].lock);
+
+	comp->stats = alloc_percpu(domblockdev_comp_stats_t);
+	comp->streams = alloc_percpu(domblockdev_comp_stream_t);
+	snprintf(comp->pool_name, sizeof(comp->pool_name), "domblockdev-%d", dev->index);
+	comp->pool = zs_create_pool(comp->pool_name);
+	if (comp->stats == NULL || comp->streams == NULL || comp->pool == NULL) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	for_each_possible_cpu(cpu) {
+		domblockdev_comp_stream_t *stream = per_cpu_ptr(comp->streams, cpu);
+
+		stream->tfm = crypto_alloc_comp(algorithm, 0, 0);
+		stream->buffer = kmalloc_node(2 * PAGE_SIZE, GFP_KERNEL, cpu_to_node(cpu));
+		stream->merge = kmalloc_node(PAGE_SIZE, GFP_KERNEL, cpu_to_node(cpu));
+		if (IS_ERR(stream->tfm) || stream->buffer == NULL || stream->merge == NULL) {
+			ret = IS_ERR(stream->tfm) ? PTR_ERR(stream->tfm) : -ENOMEM;
+			goto fail;
+		}
+	}
+
+	dev->comp = comp;
+	return 0;
+
+fail:
+	domblockdev_comp_free_streams(comp);
+	if (comp->pool)
+		zs_destroy_pool(comp->pool);
+	free_percpu(comp->stats);
+	kfree(comp);
+	return ret;
+}
+
+void domblockdev_comp_free(domblockdev_device_t* dev) {
+	domblockdev_comp_t *comp = dev->comp;
+	domblockdev_zpage_t *zp;
+	unsigned long idx;
+
+	if (comp == NULL)
+		return;
+
+	xa_for_each(&dev->pages, idx, zp) {
+		if (zp->handle)
+			zs_free(comp->pool, zp->handle);
+		kfree(zp);
+		cond_resched();
+	}
+	xa_destroy(&dev->pages);
+
+	domblockdev_comp_free_streams(comp);
+	zs_destroy_pool(comp->pool);
+	free_percpu(comp->stats);
+	kfree(comp);
+	dev->comp = NULL;
+}
+
+// /sys/block/<disk>/comp_stats
+static ssize_t comp_stats_show(struct device *d, struct device_attribute *attr, char *buf) {
+	domblockdev_device_t* dev = dev_to_disk(d)->private_data;
+	domblockdev_comp_t *comp = dev->comp;
+	domblockdev_comp_stats_t sum = {};
+	u64 orig, used;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		domblockdev_comp_stats_t *stats = per_cpu_ptr(comp->stats, cpu);
+
+		sum.compr_bytes += stats->compr_bytes;
+		sum.same_pages += stats->same_pages;
+		sum.huge_pages += stats->huge_pages;
+		sum.comp_ops += stats->comp_ops;
+		sum.comp_ns += stats->comp_ns;
+		sum.decomp_ops += stats->decomp_ops;
+		sum.decomp_ns += stats->decomp_ns;
+	}
+	orig = (u64)atomic_long_read(&dev->nr_pages) << PAGE_SHIFT;
+	used = (u64)zs_get_total_pages(comp->pool) << PAGE_SHIFT;
+
+	return scnprintf(buf, PAGE_SIZE,
+			 "algorithm      %s\n"
+			 "orig_bytes     %llu\n"
+			 "compr_bytes    %lld\n"
+			 "mem_used_bytes %llu\n"
+			 "ratio_x100     %llu\n"
+			 "same_pages     %lld\n"
+			 "huge_pages     %lld\n"
+			 "comp_ops       %llu\n"
+			 "comp_ns_per_op %llu\n"
+			 "decomp_ops     %llu\n"
+			 "decomp_ns_per_op %llu\n",
+			 comp->algorithm, orig, sum.compr_bytes, used,
+			 used ? div64_u64(orig * 100, used) : 0,
+			 sum.same_pages, sum.huge_pages,
+			 sum.comp_ops, sum.comp_ops ? div64_u64(sum.comp_ns, sum.comp_ops) : 0,
+			 sum.decomp_ops, sum.decomp_ops ? div64_u64(sum.decomp_ns, sum.decomp_ops) : 0);
+}
+static DEVICE_ATTR_RO(comp_stats);
+
+int domblockdev_comp_sysfs_init(domblockdev_device_t* dev) {
+	if (dev->comp == NULL)
+		return 0;
+	return device_create_file(disk_to_dev(dev->disk), &dev_attr_comp_stats);
+}
+
+void domblockdev_comp_sysfs_exit(domblockdev_device_t* dev) {
+	if (dev->comp)
+		device_remove_file(disk_to_dev(dev->disk), &dev_attr_comp_stats);
+}
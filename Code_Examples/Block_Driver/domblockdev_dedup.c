@@ -0,0 +1,438 @@
+// Deduplicating page store for the domblockdev ramdisk
+// With dedup=1 every page written is hashed with xxh64, and pages with the same contents
+// share one refcounted backing page. The xarray points to a domblockdev_dpage_t for each
+// page of the disk, and the same dpage is also linked into a hash table by contents hash.
+// A shared page is never written in place: a write builds the new contents on the side
+// (merging in the old page for a partial write) and then looks them up like any new page,
+// which is copy-on-write without a special case.
+// Two sets of spinlocks keep this parallel. DOMBLOCKDEV_DEDUP_LOCKS slot locks, picked by
+// page index, serialize access to one page of the disk, and the same number of hash locks,
+// picked by bucket, protect the chains and reference counts. A slot lock is always taken
+// before a hash lock. Statistics go to per-CPU counters and show up in /sys/block/<disk>/dedup_stats.
+
+#include <linux/xxhash.h>
+#include <linux/highmem.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/string.h>
+#include <linux/device.h>
+#include <linux/genhd.h>
+#include <linux/math64.h>
+
+#include "domblockdev.h"
+
+#define DOMBLOCKDEV_DEDUP_LOCKS		256
+#define DOMBLOCKDEV_DEDUP_MIN_BUCKETS	1024
+#define DOMBLOCKDEV_DEDUP_MAX_BUCKETS	(1 << 20)
+
+// One unique page of data
+typedef struct domblockdev_dpage_s {
+	struct hlist_node node;		// In the hash chain for hash
+	u64 hash;
+	unsigned int refs;		// Disk pages that point here, under the hash lock
+	struct page *page;
+} domblockdev_dpage_t;
+
+typedef struct domblockdev_dedup_stats_s {
+	s64 unique_pages;		// dpages alive
+	u64 hits;			// Writes that found their contents already stored
+	u64 misses;			// Writes that needed a new page
+	u64 cow;			// Partial writes to a page shared with others
+} domblockdev_dedup_stats_t;
+
+typedef struct domblockdev_dedup_lock_s {
+	spinlock_t lock;
+} ____cacheline_aligned_in_smp domblockdev_dedup_lock_t;
+
+struct domblockdev_dedup_s {
+	struct hlist_head *buckets;
+	unsigned int hash_bits;
+	u8 * __percpu *merge;		// One page per CPU for building new contents, used under a slot lock
+	domblockdev_dedup_stats_t __percpu *stats;
+	domblockdev_dedup_lock_t slot_locks[DOMBLOCKDEV_DEDUP_LOCKS];
+	domblockdev_dedup_lock_t hash_locks[DOMBLOCKDEV_DEDUP_LOCKS];
+};
+
+static spinlock_t *domblockdev_dedup_slot_lock(domblockdev_dedup_t *dd, pgoff_t idx) {
+	return &dd->slot_locks[idx & (DOMBLOCKDEV_DEDUP_LOCKS - 1)].lock;
+}
+
+static u32 domblockdev_dedup_bucket(domblockdev_dedup_t *dd, u64 hash) {
+	return hash >> (64 - dd->hash_bits);
+}
+
+static spinlock_t *domblockdev_dedup_hash_lock(domblockdev_dedup_t *dd, u32 bucket) {
+	return &dd->hash_locks[bucket & (DOMBLOCKDEV_DEDUP_LOCKS - 1)].lock;
+}
+
+// Drop one reference to dp, freeing it with the last one. Called with the slot lock held.
+static void domblockdev_dedup_put(domblockdev_dedup_t *dd, domblockdev_dpage_t *dp) {
+	spinlock_t *lock = domblockdev_dedup_hash_lock(dd, domblockdev_dedup_bucket(dd, dp->hash));
+	bool last;
+
+	spin_lock(lock);
+	last = --dp->refs == 0;
+	if (last)
+		hlist_del(&dp->node);
+	spin_unlock(lock);
+
+	if (last) {
+		__free_page(dp->page);
+		kfree(dp);
+		this_cpu_dec(dd->stats->unique_pages);
+	}
+}
+
+static bool domblockdev_dedup_match(domblockdev_dpage_t *dp, u64 hash, const u8 *data) {
+	bool same;
+	void *addr;
+
+	if (dp->hash != hash)
+		return false;
+	addr = kmap_atomic(dp->page);
+	same = memcmp(addr, data, PAGE_SIZE) == 0;
+	kunmap_atomic(addr);
+	return same;
+}
+
+// Find a stored page with these contents and take a reference on it, or add one
+static domblockdev_dpage_t *domblockdev_dedup_get(domblockdev_dedup_t *dd, const u8 *data) {
+	u64 hash = xxh64(data, PAGE_SIZE, 0);
+	u32 bucket = domblockdev_dedup_bucket(dd, hash);
+	spinlock_t *lock = domblockdev_dedup_hash_lock(dd, bucket);
+	domblockdev_dpage_t *dp, *fresh;
+	void *addr;
+
+	spin_lock(lock);
+	hlist_for_each_entry(dp, &dd->buckets[bucket], node) {
+		if (domblockdev_dedup_match(dp, hash, data)) {
+			dp->refs++;
+			spin_unlock(lock);
+			this_cpu_inc(dd->stats->hits);
+			return dp;
+		}
+	}
+	spin_unlock(lock);
+
+	// Not there, set up a new page without holding the lock and look again before adding it
+	fresh = kmalloc(sizeof(*fresh), GFP_NOWAIT | __GFP_NOWARN);
+	if (fresh == NULL)
+		return NULL;
+	fresh->page = alloc_page(GFP_NOWAIT | __GFP_NOWARN | __GFP_HIGHMEM);
+	if (fresh->page == NULL) {
+		kfree(fresh);
+		return NULL;
+	}
+	addr = kmap_atomic(fresh->page);
+	memcpy(addr, data, PAGE_SIZE);
+	kunmap_atomic(addr);
+	fresh->hash = hash;
+	fresh->refs = 1;
+
+	spin_lock(lock);
+	hlist_for_each_entry(dp, &dd->buckets[bucket], node) {
+		if (domblockdev_dedup_match(dp, hash, data)) {
+			dp->refs++;
+			spin_unlock(lock);
+			__free_page(fresh->page);
+			kfree(fresh);
+			this_cpu_inc(dd->stats->hits);
+			return dp;
+		}
+	}
+	hlist_add_head(&fresh->node, &dd->buckets[bucket]);
+	spin_unlock(lock);
+
+	this_cpu_inc(dd->stats->misses);
+	this_cpu_inc(dd->stats->unique_pages);
+	return fresh;
+}
+
+static bool domblockdev_dedup_zero_filled(const u8 *data) {
+	return memchr_inv(data, 0, PAGE_SIZE) == NULL;
+}
+
+// Point the disk page at idx to a page with these contents. Called with the slot lock held.
+static int domblockdev_dedup_set(domblockdev_device_t* dev, pgoff_t idx, const u8 *data) {
+	domblockdev_dedup_t *dd = dev->dedup;
+	domblockdev_dpage_t *dp = NULL, *old;
+
+	// Zeros are not worth an entry, they read back the same without one
+	if (!domblockdev_dedup_zero_filled(data)) {
+		dp = domblockdev_dedup_get(dd, data);
+		if (dp == NULL)
+			return -ENOMEM;
+	}
+
+	old = dp ? xa_store(&dev->pages, idx, dp, GFP_NOWAIT | __GFP_NOWARN) : xa_erase(&dev->pages, idx);
+	if (xa_is_err(old)) {
+		domblockdev_dedup_put(dd, dp);
+		return xa_err(old);
+	}
+
+	if (dp && old == NULL)
+		atomic_long_inc(&dev->nr_pages);
+	else if (dp == NULL && old)
+		atomic_long_dec(&dev->nr_pages);
+	if (old)
+		domblockdev_dedup_put(dd, old);
+
+	return 0;
+}
+
+// Copy the current contents of the disk page at idx into buf. Called with the slot lock held.
+static void domblockdev_dedup_load(domblockdev_device_t* dev, pgoff_t idx, u8 *buf) {
+	domblockdev_dpage_t *dp = xa_load(&dev->pages, idx);
+
+	if (dp) {
+		void *addr = kmap_atomic(dp->page);
+		memcpy(buf, addr, PAGE_SIZE);
+		kunmap_atomic(addr);
+	}
+	else
+		memset(buf, 0, PAGE_SIZE);
+}
+
+int domblockdev_dedup_write(domblockdev_device_t* dev, sector_t sector, struct page *page, unsigned int offset, unsigned int len) {
+	domblockdev_dedup_t *dd = dev->dedup;
+	int ret = 0;
+
+	while (len && ret == 0) {
+		pgoff_t idx = sector >> DOMBLOCKDEV_PAGE_SECTORS_SHIFT;
+		unsigned int pg_off = (sector & (DOMBLOCKDEV_PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+		unsigned int chunk = min_t(unsigned int, len, PAGE_SIZE - pg_off);
+		spinlock_t *lock = domblockdev_dedup_slot_lock(dd, idx);
+		u8 *src;
+
+		spin_lock(lock);
+		src = kmap_atomic(page);
+		if (chunk == PAGE_SIZE)
+			ret = domblockdev_dedup_set(dev, idx, src + offset);
+		else {
+			u8 *merge = *this_cpu_ptr(dd->merge);
+			domblockdev_dpage_t *dp = xa_load(&dev->pages, idx);
+
+			if (dp && READ_ONCE(dp->refs) > 1)
+				this_cpu_inc(dd->stats->cow);
+			domblockdev_dedup_load(dev, idx, merge);
+			memcpy(merge + pg_off, src + offset, chunk);
+			ret = domblockdev_dedup_set(dev, idx, merge);
+		}
+		kunmap_atomic(src);
+		spin_unlock(lock);
+
+		sector += chunk >> SECTOR_SHIFT;
+		offset += chunk;
+		len -= chunk;
+	}
+
+	return ret;
+}
+
+int domblockdev_dedup_read(domblockdev_device_t* dev, sector_t sector, struct page *page, unsigned int offset, unsigned int len) {
+	domblockdev_dedup_t *dd = dev->dedup;
+
+	while (len) {
+		pgoff_t idx = sector >> DOMBLOCKDEV_PAGE_SECTORS_SHIFT;
+		unsigned int pg_off = (sector & (DOMBLOCKDEV_PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+		unsigned int chunk = min_t(unsigned int, len, PAGE_SIZE - pg_off);
+		spinlock_t *lock = domblockdev_dedup_slot_lock(dd, idx);
+		domblockdev_dpage_t *dp;
+		u8 *dst;
+
+		spin_lock(lock);
+		dp = xa_load(&dev->pages, idx);
+		dst = kmap_atomic(page);
+		if (dp) {
+			void *src = kmap_atomic(dp->page);
+			memcpy(dst + offset, src + pg_off, chunk);
+			kunmap_atomic(src);
+		}
+		else
+			memset(dst + offset, 0, chunk);
+		kunmap_atomic(dst);
+		spin_unlock(lock);
+
+		sector += chunk >> SECTOR_SHIFT;
+		offset += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+// Clear sectors [pg_sect, pg_sect + nr) of the disk page at idx
+static int domblockdev_dedup_zero_page(domblockdev_device_t* dev, pgoff_t idx, unsigned int pg_sect, unsigned int nr) {
+	domblockdev_dedup_t *dd = dev->dedup;
+	spinlock_t *lock = domblockdev_dedup_slot_lock(dd, idx);
+	domblockdev_dpage_t *dp;
+	int ret = 0;
+
+	spin_lock(lock);
+	dp = xa_load(&dev->pages, idx);
+	if (dp && nr == DOMBLOCKDEV_PAGE_SECTORS) {
+		xa_erase(&dev->pages, idx);
+		atomic_long_dec(&dev->nr_pages);
+		domblockdev_dedup_put(dd, dp);
+	}
+	else if (dp) {
+		u8 *merge = *this_cpu_ptr(dd->merge);
+
+		domblockdev_dedup_load(dev, idx, merge);
+		memset(merge + (pg_sect << SECTOR_SHIFT), 0, nr << SECTOR_SHIFT);
+		ret = domblockdev_dedup_set(dev, idx, merge);
+	}
+	spin_unlock(lock);
+
+	return ret;
+}
+
+// Discard and write-zeroes
+int domblockdev_dedup_zero(domblockdev_device_t* dev, sector_t sector, sector_t nr_sects) {
+	return domblockdev_store_zero_pages(dev, sector, nr_sects, domblockdev_dedup_zero_page);
+}
+
+static void domblockdev_dedup_free_merge(domblockdev_dedup_t *dd) {
+	int cpu;
+
+	if (dd->merge == NULL)
+		return;
+	for_each_possible_cpu(cpu)
+		kfree(*per_cpu_ptr(dd->merge, cpu));
+	free_percpu(dd->merge);
+}
+
+int domblockdev_dedup_init(domblockdev_device_t* dev) {
+	unsigned long buckets = (dev->capacity >> DOMBLOCKDEV_PAGE_SECTORS_SHIFT) / 4;
+	domblockdev_dedup_t *dd;
+	int i, cpu;
+
+	dd = kzalloc(sizeof(*dd), GFP_KERNEL);
+	if (dd == NULL)
+		return -ENOMEM;
+	for (i = 0; i < DOMBLOCKDEV_DEDUP_LOCKS; i++) {
+		spin_lock_init(&dd->slot_locks[i].lock);
+		spin_lock_init(&dd->hash_locks[i].lock);
+	}
+
+	// About one bucket per four pages of disk
+	buckets = clamp_t(unsigned long, buckets, DOMBLOCKDEV_DEDUP_MIN_BUCKETS, DOMBLOCKDEV_DEDUP_MAX_BUCKETS);
+	dd->hash_bits = ilog2(roundup_pow_of_two(buckets));
+	dd->buckets = kvcalloc(1UL << dd->hash_bits, sizeof(struct hlist_head), GFP_KERNEL);
+	dd->stats = alloc_percpu(domblockdev_dedup_stats_t);
+	dd->merge = alloc_percpu(u8 *);
+	if (dd->buckets == NULL || dd->stats == NULL || dd->merge == NULL)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		u8 *buf = kmalloc_node(PAGE_SIZE, GFP_KERNEL, cpu_to_node(cpu));
+		if (buf == NULL)
+			goto fail;
+		*per_cpu_ptr(dd->merge, cpu) = buf;
+	}
+
+	dev->dedup = dd;
+	return 0;
+
+fail:
+	domblockdev_dedup_free_merge(dd);
+	free_percpu(dd->stats);
+	kvfree(dd->buckets);
+	kfree(dd);
+	return -ENOMEM;
+}
+
+void domblockdev_dedup_free(domblockdev_device_t* dev) {
+	domblockdev_dedup_t *dd = dev->dedup;
+	domblockdev_dpage_t *dp;
+	struct hlist_node *tmp;
+	unsigned long i;
+
+	if (dd == NULL)
+		return;
+
+	// Every dpage is in exactly one chain, however many disk pages point to it
+	xa_destroy(&dev->pages);
+	for (i = 0; i < (1UL << dd->hash_bits); i++) {
+		hlist_for_each_entry_safe(dp, tmp, &dd->buckets[i], node) {
+			__free_page(dp->page);
+			kfree(dp);
+		}
+		cond_resched();
+	}
+
+	domblockdev_dedup_free_merge(dd);
+	free_percpu(dd->stats);
+	kvfree(dd->buckets);
+	kfree(dd);
+	dev->dedup = NULL;
+}
+
+// /sys/block/<disk>/dedup_stats
+static ssize_t dedup_stats_show(struct device *d, struct device_attribute *attr, char *buf) {
+	domblockdev_device_t* dev = dev_to_disk(d)->private_data;
+	domblockdev_dedup_t *dd = dev->dedup;
+	domblockdev_dedup_stats_t sum = {};
+	unsigned long nr_buckets = 1UL << dd->hash_bits, used = 0, longest = 0, i;
+	s64 logical;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		domblockdev_dedup_stats_t *stats = per_cpu_ptr(dd->stats, cpu);
+
+		sum.unique_pages += stats->unique_pages;
+		sum.hits += stats->hits;
+		sum.misses += stats->misses;
+		sum.cow += stats->cow;
+	}
+
+	// Walk the chains for the load figures, one lock at a time
+	for (i = 0; i < nr_buckets; i++) {
+		spinlock_t *lock = domblockdev_dedup_hash_lock(dd, i);
+		unsigned long len = 0;
+		domblockdev_dpage_t *dp;
+
+		spin_lock(lock);
+		hlist_for_each_entry(dp, &dd->buckets[i], node)
+			len++;
+		spin_unlock(lock);
+
+		if (len)
+			used++;
+		longest = max(longest, len);
+		if ((i & 1023) == 1023)
+			cond_resched();
+	}
+
+	logical = atomic_long_read(&dev->nr_pages);
+	return scnprintf(buf, PAGE_SIZE,
+			 "logical_pages   %lld\n"
+			 "unique_pages    %lld\n"
+			 "dedup_x100      %lld\n"
+			 "write_hits      %llu\n"
+			 "write_misses    %llu\n"
+			 "cow_writes      %llu\n"
+			 "buckets         %lu\n"
+			 "buckets_used    %lu\n"
+			 "load_x100       %lld\n"
+			 "longest_chain   %lu\n",
+			 logical, sum.unique_pages,
+			 sum.unique_pages > 0 ? div64_s64(logical * 100, sum.unique_pages) : 0,
+			 sum.hits, sum.misses, sum.cow,
+			 nr_buckets, used, div64_s64(sum.unique_pages * 100, nr_buckets), longest);
+}
+static DEVICE_ATTR_RO(dedup_stats);
+
+int domblockdev_dedup_sysfs_init(domblockdev_device_t* dev) {
+	if (dev->dedup == NULL)
+		return 0;
+	return device_create_file(disk_to_dev(dev->disk), &dev_attr_dedup_stats);
+}
+
+void domblockdev_dedup_sysfs_exit(domblockdev_device_t* dev) {
+	if (dev->dedup)
+		device_remove_file(disk_to_dev(dev->disk), &dev_attr_dedup_stats);
+}
@@ -0,0 +1,154 @@
+// Request histograms for the domblockdev ramdisk
+// Every hardware queue counts the requests it sees in log2 buckets: size, segments
+// (bio_vecs walked by rq_for_each_segment), merges (bios beyond the first in a request) and
+// latency from the request's start time to its completion. The counters are atomics in the
+// hctx's own allocation on its node, like the other queue counters: only the CPUs mapped to the
+// queue touch them, so they stay uncontended, and a disk costs one histogram per queue instead
+// of one per queue and CPU. debugfs/domblockdev/<disk_name>/histograms shows them, and writing
+// anything to it starts the counts over.
+//
+// Bucket 0 counts zeros and bucket b counts values in [2^(b-1), 2^b), the last bucket takes
+// everything bigger.
+
+#include <linux/slab.h>
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/bio.h>
+
+#include "domblockdev.h"
+
+enum {
+	DOMBLOCKDEV_HIST_SIZE = 0,	// bytes
+	DOMBLOCKDEV_HIST_SEGMENTS,
+	DOMBLOCKDEV_HIST_MERGES,
+	DOMBLOCKDEV_HIST_LATENCY,	// nanoseconds
+	DOMBLOCKDEV_NR_HISTS,
+};
+
+#define DOMBLOCKDEV_HIST_BUCKETS	40	// the latency histogram reaches 2^38 ns, about 4.5 minutes
+
+static const char * const _hist_names[] = {
+	[DOMBLOCKDEV_HIST_SIZE] = "size_bytes",
+	[DOMBLOCKDEV_HIST_SEGMENTS] = "segments",
+	[DOMBLOCKDEV_HIST_MERGES] = "merges",
+	[DOMBLOCKDEV_HIST_LATENCY] = "latency_ns",
+};
+
+struct domblockdev_hist_s {
+	atomic64_t buckets[DOMBLOCKDEV_NR_HISTS][DOMBLOCKDEV_HIST_BUCKETS];
+};
+
+static unsigned int domblockdev_hist_bucket(u64 value) {
+	if (value == 0)
+		return 0;
+	return min_t(unsigned int, ilog2(value) + 1, DOMBLOCKDEV_HIST_BUCKETS - 1);
+}
+
+static void domblockdev_hist_add(domblockdev_queue_t *q, int hist, u64 value) {
+	atomic64_inc(&q->hist->buckets[hist][domblockdev_hist_bucket(value)]);
+}
+
+int domblockdev_hist_alloc(domblockdev_queue_t *q, int node) {
+	q->hist = kzalloc_node(sizeof(domblockdev_hist_t), GFP_KERNEL, node);
+	return q->hist ? 0 : -ENOMEM;
+}
+
+void domblockdev_hist_free(domblockdev_queue_t *q) {
+	kfree(q->hist);
+	q->hist = NULL;
+}
+
+// Called from _queue_rq once the data has been copied
+void domblockdev_hist_queue(domblockdev_queue_t *q, struct request *rq, unsigned int nr_segs) {
+	domblockdev_cmd_t *cmd = blk_mq_rq_to_pdu(rq);
+	unsigned int nr_bios = 0;
+	struct bio *bio;
+
+	// blk-mq stamps the request when it is allocated unless nothing in the queue needs the time
+	cmd->start_ns = rq->start_time_ns ? rq->start_time_ns : ktime_get_ns();
+
+	__rq_for_each_bio(bio, rq)
+		nr_bios++;
+
+	domblockdev_hist_add(q, DOMBLOCKDEV_HIST_SIZE, blk_rq_bytes(rq));
+	domblockdev_hist_add(q, DOMBLOCKDEV_HIST_SEGMENTS, nr_segs);
+	domblockdev_hist_add(q, DOMBLOCKDEV_HIST_MERGES, nr_bios ? nr_bios - 1 : 0);
+}
+
+// Called right before a request is ended, whichever way it completes
+void domblockdev_hist_end(struct request *rq) {
+	domblockdev_cmd_t *cmd = blk_mq_rq_to_pdu(rq);
+	domblockdev_queue_t *q = rq->mq_hctx->driver_data;
+
+	domblockdev_hist_add(q, DOMBLOCKDEV_HIST_LATENCY, ktime_get_ns() - cmd->start_ns);
+}
+
+// One line per hardware queue, histogram and bucket that is not empty
+static int _histograms_show(struct seq_file *s, void *unused) {
+	domblockdev_device_t* dev = s->private;
+	unsigned int i, h, b;
+
+	seq_printf(s, "%-6s %-12s %14s %14s %14s\n", "hctx", "histogram", "from", "below", "count");
+	for (i = 0; i < dev->nr_queues; i++) {
+		domblockdev_queue_t *q = dev->queues[i];
+		if (q == NULL)
+			continue;
+
+		for (h = 0; h < DOMBLOCKDEV_NR_HISTS; h++) {
+			for (b = 0; b < DOMBLOCKDEV_HIST_BUCKETS; b++) {
+				u64 count = atomic64_read(&q->hist->buckets[h][b]);
+
+				if (count == 0)
+					continue;
+
+				if (b == DOMBLOCKDEV_HIST_BUCKETS - 1)
+					seq_printf(s, "%-6u %-12s %14llu %14s %14llu\n", i, _hist_names[h], 1ULL << (b - 1), "-", count);
+				else
+					seq_printf(s, "%-6u %-12s %14llu %14llu %14llu\n", i, _hist_names[h],
+						   b ? 1ULL << (b - 1) : 0, 1ULL << b, count);
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int _histograms_open(struct inode *inode, struct file *file) {
+	return single_open(file, _histograms_show, inode->i_private);
+}
+
+// Any write clears every histogram of the disk. Counts that land while this runs may
+// survive it, which is fine for a reset knob.
+static ssize_t _histograms_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+	domblockdev_device_t* dev = ((struct seq_file *)file->private_data)->private;
+	unsigned int i, h, b;
+
+	for (i = 0; i < dev->nr_queues; i++) {
+		domblockdev_queue_t *q = dev->queues[i];
+		if (q == NULL)
+			continue;
+		for (h = 0; h < DOMBLOCKDEV_NR_HISTS; h++)
+			for (b = 0; b < DOMBLOCKDEV_HIST_BUCKETS; b++)
+				atomic64_set(&q->hist->buckets[h][b], 0);
+	}
+
+	return count;
+}
+
+static const struct file_operations _histograms_fops = {
+	.owner = THIS_MODULE,
+	.open = _histograms_open,
+	.read = seq_read,
+	.write = _histograms_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+void domblockdev_hist_debugfs_init(domblockdev_device_t* dev) {
+	debugfs_create_file("histograms", S_IRUSR | S_IWUSR, dev->debugfs_dir, dev, &_histograms_fops);
+}
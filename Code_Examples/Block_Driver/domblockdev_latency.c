@@ -0,0 +1,266 @@
+// Asynchronous completions with a simulated device latency model
+// By default domblockdev completes every request inside _queue_rq, which no real device does.
+// With latency_mode set, each request gets a completion time and an hrtimer completes it then:
+//   fixed      every request takes latency_ns
+//   uniform    latency is uniform between latency_ns and latency_max_ns
+//   histogram  latency is drawn from latency_histogram, a list of "<upper_ns>:<weight>" buckets
+// On top of that, bandwidth_mbps caps the throughput of the whole device. Every request reserves
+// its transfer time on a shared timeline, so a burst queues up behind the cap like on a real link.
+// All of these parameters can be changed at runtime under /sys/module/domsblockdev/parameters.
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/hrtimer.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/math64.h>
+
+#include "domblockdev.h"
+
+enum domblockdev_latency_mode {
+	DOMBLOCKDEV_LATENCY_NONE = 0,	// complete inline in _queue_rq
+	DOMBLOCKDEV_LATENCY_FIXED,
+	DOMBLOCKDEV_LATENCY_UNIFORM,
+	DOMBLOCKDEV_LATENCY_HISTOGRAM,
+};
+
+static const char * const _latency_mode_names[] = {
+	[DOMBLOCKDEV_LATENCY_NONE] = "none",
+	[DOMBLOCKDEV_LATENCY_FIXED] = "fixed",
+	[DOMBLOCKDEV_LATENCY_UNIFORM] = "uniform",
+	[DOMBLOCKDEV_LATENCY_HISTOGRAM] = "histogram",
+};
+
+// A latency histogram. Bucket i covers (upper_ns[i - 1], upper_ns[i]] and is picked with
+// probability weight / total, cum holds the running sum of the weights for the binary search.
+typedef struct domblockdev_latency_hist_s {
+	struct rcu_head rcu;
+	unsigned int nr;
+	u32 total;
+	struct {
+		u64 upper_ns;
+		u32 cum;
+	} bucket[];
+} domblockdev_latency_hist_t;
+
+static int latency_mode = DOMBLOCKDEV_LATENCY_NONE;
+static unsigned long latency_ns = 10000;
+static unsigned long latency_max_ns = 100000;
+static unsigned int bandwidth_mbps = 0;
+static domblockdev_latency_hist_t __rcu *_latency_hist = NULL;
+static DEFINE_MUTEX(_latency_hist_mutex);
+
+static int _latency_mode_set(const char *val, const struct kernel_param *kp) {
+	int mode = sysfs_match_string(_latency_mode_names, val);
+
+	if (mode < 0)
+		return -EINVAL;
+	WRITE_ONCE(latency_mode, mode);
+	return 0;
+}
+
+static int _latency_mode_get(char *buffer, const struct kernel_param *kp) {
+	return sprintf(buffer, "%s\n", _latency_mode_names[READ_ONCE(latency_mode)]);
+}
+
+static const struct kernel_param_ops _latency_mode_ops = {
+	.set = _latency_mode_set,
+	.get = _latency_mode_get,
+};
+module_param_cb(latency_mode, &_latency_mode_ops, NULL, 0644);
+MODULE_PARM_DESC(latency_mode, "Completion latency model: none (inline), fixed, uniform or histogram");
+
+module_param(latency_ns, ulong, 0644);
+MODULE_PARM_DESC(latency_ns, "Fixed latency, or the lower bound of the uniform model, in ns");
+module_param(latency_max_ns, ulong, 0644);
+MODULE_PARM_DESC(latency_max_ns, "Upper bound of the uniform model in ns");
+module_param(bandwidth_mbps, uint, 0644);
+MODULE_PARM_DESC(bandwidth_mbps, "Throughput cap for the whole device in MB/s (0 = unlimited)");
+
+// Parse "<upper_ns>:<weight>[,<upper_ns>:<weight>...]" with increasing upper_ns
+static int _latency_histogram_set(const char *val, const struct kernel_param *kp) {
+	domblockdev_latency_hist_t *hist, *old;
+	unsigned int nr = 1, i = 0;
+	u64 total = 0, prev = 0;
+	char *buf, *cur, *tok;
+	int ret = 0;
+	const char *p;
+
+	for (p = val; *p; p++)
+		if (*p == ',')
+			nr++;
+
+	hist = kzalloc(struct_size(hist, bucket, nr), GFP_KERNEL);
+	buf = kstrdup(val, GFP_KERNEL);
+	if (hist == NULL || buf == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	cur = strim(buf);
+	while ((tok = strsep(&cur, ",")) != NULL) {
+		char *weight = strchr(tok, ':');
+		u64 upper;
+		u32 w;
+
+		if (weight == NULL) {
+			ret = -EINVAL;
+			goto out;
+		}
+		*weight++ = '\0';
+		if (kstrtou64(tok, 0, &upper) || kstrtou32(weight, 0, &w) || upper < prev) {
+			ret = -EINVAL;
+			goto out;
+		}
+
+		total += w;
+		if (total > U32_MAX) {
+			ret = -ERANGE;
+			goto out;
+		}
+		hist->bucket[i].upper_ns = upper;
+		hist->bucket[i].cum = total;
+		prev = upper;
+		i++;
+	}
+	if (total == 0) {
+		ret = -EINVAL;
+		goto out;
+	}
+	hist->nr = i;
+	hist->total = total;
+
+	mutex_lock(&_latency_hist_mutex);
+	old = rcu_dereference_protected(_latency_hist, lockdep_is_held(&_latency_hist_mutex));
+	rcu_assign_pointer(_latency_hist, hist);
+	mutex_unlock(&_latency_hist_mutex);
+	if (old)
+		kfree_rcu(old, rcu);
+	hist = NULL;
+
+out:
+	kfree(buf);
+	kfree(hist);
+	return ret;
+}
+
+static int _latency_histogram_get(char *buffer, const struct kernel_param *kp) {
+	domblockdev_latency_hist_t *hist;
+	unsigned int i, prev = 0;
+	int len = 0;
+
+	rcu_read_lock();
+	hist = rcu_dereference(_latency_hist);
+	for (i = 0; hist && i < hist->nr; i++) {
+		len += scnprintf(buffer + len, PAGE_SIZE - len, "%s%llu:%u", i ? "," : "",
+				 hist->bucket[i].upper_ns, hist->bucket[i].cum - prev);
+		prev = hist->bucket[i].cum;
+	}
+	rcu_read_unlock();
+	len += scnprintf(buffer + len, PAGE_SIZE - len, "\n");
+
+	return len;
+}
+
+static const struct kernel_param_ops _latency_histogram_ops = {
+	.set = _latency_histogram_set,
+	.get = _latency_histogram_get,
+};
+module_param_cb(latency_histogram, &_latency_histogram_ops, NULL, 0644);
+MODULE_PARM_DESC(latency_histogram, "Latency histogram as <upper_ns>:<weight>,... for latency_mode=histogram");
+
+static u64 domblockdev_latency_sample_hist(void) {
+	domblockdev_latency_hist_t *hist;
+	unsigned int lo, hi;
+	u64 lower, ns = 0;
+	u32 r;
+
+	rcu_read_lock();
+	hist = rcu_dereference(_latency_hist);
+	if (hist) {
+		r = prandom_u32_max(hist->total);
+		lo = 0;
+		hi = hist->nr - 1;
+		while (lo < hi) {
+			unsigned int mid = (lo + hi) / 2;
+			if (r < hist->bucket[mid].cum)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		lower = lo ? hist->bucket[lo - 1].upper_ns : 0;
+		ns = lower + mul_u64_u32_shr(hist->bucket[lo].upper_ns - lower, prandom_u32(), 32);
+	}
+	rcu_read_unlock();
+
+	return ns;
+}
+
+static u64 domblockdev_latency_sample(int mode) {
+	u64 lo = READ_ONCE(latency_ns), hi;
+
+	switch (mode) {
+	case DOMBLOCKDEV_LATENCY_FIXED:
+		return lo;
+	case DOMBLOCKDEV_LATENCY_UNIFORM:
+		hi = READ_ONCE(latency_max_ns);
+		if (hi <= lo)
+			return lo;
+		return lo + mul_u64_u32_shr(hi - lo, prandom_u32(), 32);
+	case DOMBLOCKDEV_LATENCY_HISTOGRAM:
+		return domblockdev_latency_sample_hist();
+	}
+	return 0;
+}
+
+// Reserve nr_bytes of transfer time on the device timeline and return when the transfer ends
+static u64 domblockdev_bandwidth_reserve(domblockdev_device_t* dev, unsigned int mbps, unsigned int nr_bytes, u64 now) {
+	u64 xfer = div_u64((u64)nr_bytes * 1000, mbps); // 1 MB/s is 1000 ns per byte
+	s64 old, start;
+
+	do {
+		old = atomic64_read(&dev->bw_next_ns);
+		start = max_t(s64, old, now);
+	} while (atomic64_cmpxchg(&dev->bw_next_ns, old, start + xfer) != old);
+
+	return start + xfer;
+}
+
+bool domblockdev_latency_enabled(void) {
+	return READ_ONCE(latency_mode) != DOMBLOCKDEV_LATENCY_NONE || READ_ONCE(bandwidth_mbps);
+}
+
+// Arm the completion timer of a request whose data has already been copied
+void domblockdev_latency_start(domblockdev_device_t* dev, struct request *rq, unsigned int nr_bytes) {
+	domblockdev_cmd_t *cmd = blk_mq_rq_to_pdu(rq);
+	unsigned int mbps = READ_ONCE(bandwidth_mbps);
+	u64 now = ktime_get_ns();
+	u64 deadline = now + domblockdev_latency_sample(READ_ONCE(latency_mode));
+
+	if (mbps && nr_bytes)
+		deadline = max(deadline, domblockdev_bandwidth_reserve(dev, mbps, nr_bytes, now));
+
+	hrtimer_start(&cmd->timer, ns_to_ktime(deadline), HRTIMER_MODE_ABS);
+}
+
+static enum hrtimer_restart domblockdev_latency_timer(struct hrtimer *timer) {
+	domblockdev_cmd_t *cmd = container_of(timer, domblockdev_cmd_t, timer);
+	struct request *rq = blk_mq_rq_from_pdu(cmd);
+
+	domblockdev_complete(rq->mq_hctx->driver_data, rq);
+	return HRTIMER_NORESTART;
+}
+
+void domblockdev_latency_init_cmd(domblockdev_cmd_t *cmd) {
+	hrtimer_init(&cmd->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	cmd->timer.function = domblockdev_latency_timer;
+}
+
+void domblockdev_latency_exit(void) {
+	kfree(rcu_dereference_protected(_latency_hist, true));
+	RCU_INIT_POINTER(_latency_hist, NULL);
+}
@@ -0,0 +1,326 @@
+// Snapshot and restore of the domblockdev contents to a file
+//   echo /var/cache/scratch.img > /sys/block/domblockdev-0/snapshot
+//   echo /var/cache/scratch.img > /sys/block/domblockdev-0/restore
+// The image is a plain sparse file of the same size as the disk, so it can also be
+// inspected or loop mounted. Only pages that exist in the store are written, and the
+// holes in the file (plus pages that read back as all zeros) are skipped on restore.
+// Both directions move up to DOMBLOCKDEV_SNAPSHOT_CHUNK pages per call straight from and
+// into the backing pages with a bvec iterator, and use O_DIRECT when the filesystem has it.
+// Restore splits the file into one range per online CPU and reads them in parallel.
+// A snapshot freezes the queue while it runs, so writes wait and the image is one point in time.
+
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/uio.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/workqueue.h>
+#include <linux/cpumask.h>
+#include <linux/mutex.h>
+#include <linux/device.h>
+#include <linux/genhd.h>
+#include <linux/sizes.h>
+
+#include "domblockdev.h"
+
+#define DOMBLOCKDEV_SNAPSHOT_CHUNK	256	// pages per read/write call, 1 MB with 4k pages
+
+typedef struct domblockdev_restore_work_s {
+	struct work_struct work;
+	domblockdev_device_t *dev;
+	struct file *file;
+	loff_t start;			// Byte range of the file this worker restores
+	loff_t end;
+	int ret;
+} domblockdev_restore_work_t;
+
+static struct file *domblockdev_snapshot_open(const char *path, int flags) {
+	struct file *file = filp_open(path, flags | O_LARGEFILE | O_DIRECT, 0600);
+
+	// Not every filesystem does O_DIRECT, the page cache will do as well
+	if (IS_ERR(file) && PTR_ERR(file) == -EINVAL)
+		file = filp_open(path, flags | O_LARGEFILE, 0600);
+	return file;
+}
+
+static int domblockdev_snapshot_save(domblockdev_device_t* dev, const char *path) {
+	struct page **pages;
+	struct bio_vec *bvec;
+	struct file *file;
+	pgoff_t idx = 0, max = (dev->capacity >> DOMBLOCKDEV_PAGE_SECTORS_SHIFT) - 1;
+	unsigned int nr, i;
+	int ret = 0;
+
+	pages = kcalloc(DOMBLOCKDEV_SNAPSHOT_CHUNK, sizeof(*pages), GFP_KERNEL);
+	bvec = kcalloc(DOMBLOCKDEV_SNAPSHOT_CHUNK, sizeof(*bvec), GFP_KERNEL);
+	if (pages == NULL || bvec == NULL) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	file = domblockdev_snapshot_open(path, O_WRONLY | O_CREAT | O_TRUNC);
+	if (IS_ERR(file)) {
+		ret = PTR_ERR(file);
+		goto out_free;
+	}
+
+	// Size the file up front, everything we don't write stays a hole
+	ret = vfs_truncate(&file->f_path, (loff_t)dev->capacity << SECTOR_SHIFT);
+	if (ret)
+		goto out_close;
+
+	while ((nr = domblockdev_store_get_pages(dev, &idx, max, pages, DOMBLOCKDEV_SNAPSHOT_CHUNK))) {
+		loff_t pos = (loff_t)idx << PAGE_SHIFT;
+		struct iov_iter iter;
+		ssize_t written;
+
+		for (i = 0; i < nr; i++) {
+			bvec[i].bv_page = pages[i];
+			bvec[i].bv_offset = 0;
+			bvec[i].bv_len = PAGE_SIZE;
+		}
+		iov_iter_bvec(&iter, WRITE, bvec, nr, nr << PAGE_SHIFT);
+		written = vfs_iter_write(file, &iter, &pos, 0);
+
+		for (i = 0; i < nr; i++)
+			put_page(pages[i]);
+
+		if (written != (ssize_t)nr << PAGE_SHIFT) {
+			ret = written < 0 ? written : -EIO;
+			break;
+		}
+		if (idx + nr > max)
+			break;
+		idx += nr;
+		cond_resched();
+	}
+
+	if (ret == 0)
+		ret = vfs_fsync(file, 0);
+
+out_close:
+	filp_close(file, NULL);
+out_free:
+	kfree(bvec);
+	kfree(pages);
+	return ret;
+}
+
+// Throw the whole contents away. domblockdev_store_zero can't reschedule, so go a bit at a time.
+static int domblockdev_snapshot_zero(domblockdev_device_t* dev) {
+	sector_t sector, nr;
+	int ret = 0;
+
+	for (sector = 0; sector < dev->capacity && ret == 0; sector += nr) {
+		nr = min_t(sector_t, dev->capacity - sector, DOMBLOCKDEV_MAX_DISCARD_SECTORS);
+		ret = domblockdev_store_zero(dev, sector, nr);
+		cond_resched();
+	}
+	return ret;
+}
+
+// Read one data extent [pos, end) of the image into new pages
+static int domblockdev_restore_extent(domblockdev_device_t* dev, struct file *file, loff_t pos, loff_t end,
+				      struct page **pages, struct bio_vec *bvec) {
+	while (pos < end) {
+		pgoff_t idx = pos >> PAGE_SHIFT;
+		unsigned int nr = min_t(loff_t, DOMBLOCKDEV_SNAPSHOT_CHUNK, (end - pos) >> PAGE_SHIFT);
+		struct iov_iter iter;
+		ssize_t got;
+		unsigned int i;
+		int ret = 0;
+
+		for (i = 0; i < nr; i++) {
+			pages[i] = alloc_pages_node(domblockdev_store_node(dev, idx + i), GFP_KERNEL | __GFP_HIGHMEM, 0);
+			if (pages[i] == NULL) {
+				while (i--)
+					__free_page(pages[i]);
+				return -ENOMEM;
+			}
+			bvec[i].bv_page = pages[i];
+			bvec[i].bv_offset = 0;
+			bvec[i].bv_len = PAGE_SIZE;
+		}
+
+		iov_iter_bvec(&iter, READ, bvec, nr, nr << PAGE_SHIFT);
+		got = vfs_iter_read(file, &iter, &pos, 0);
+		if (got != (ssize_t)nr << PAGE_SHIFT)
+			ret = got < 0 ? got : -EIO;
+
+		for (i = 0; i < nr; i++) {
+			void *addr = kmap_atomic(pages[i]);
+			bool zero = memchr_inv(addr, 0, PAGE_SIZE) == NULL;
+
+			kunmap_atomic(addr);
+			// Keep the disk sparse: a page of zeros reads the same as no page at all
+			if (ret || zero || domblockdev_store_add_page(dev, idx + i, pages[i]))
+				__free_page(pages[i]);
+		}
+		if (ret)
+			return ret;
+		cond_resched();
+	}
+
+	return 0;
+}
+
+static void domblockdev_restore_work(struct work_struct *work) {
+	domblockdev_restore_work_t *rw = container_of(work, domblockdev_restore_work_t, work);
+	struct page **pages;
+	struct bio_vec *bvec;
+	loff_t pos = rw->start;
+
+	pages = kcalloc(DOMBLOCKDEV_SNAPSHOT_CHUNK, sizeof(*pages), GFP_KERNEL);
+	bvec = kcalloc(DOMBLOCKDEV_SNAPSHOT_CHUNK, sizeof(*bvec), GFP_KERNEL);
+	if (pages == NULL || bvec == NULL) {
+		rw->ret = -ENOMEM;
+		goto out;
+	}
+
+	while (pos < rw->end) {
+		// Both seeks only return a position, the shared file->f_pos is not used for anything
+		loff_t data = vfs_llseek(rw->file, pos, SEEK_DATA);
+		loff_t hole;
+
+		if (data == -ENXIO || data >= rw->end)	// no more data in our range
+			break;
+		if (data < 0) {
+			rw->ret = data;
+			break;
+		}
+		hole = vfs_llseek(rw->file, data, SEEK_HOLE);
+		if (hole < 0) {
+			rw->ret = hole;
+			break;
+		}
+
+		data = round_down(data, PAGE_SIZE);
+		hole = min(round_up(hole, PAGE_SIZE), rw->end);
+		rw->ret = domblockdev_restore_extent(rw->dev, rw->file, data, hole, pages, bvec);
+		if (rw->ret)
+			break;
+		pos = hole;
+	}
+
+out:
+	kfree(bvec);
+	kfree(pages);
+}
+
+static int domblockdev_snapshot_restore(domblockdev_device_t* dev, const char *path) {
+	domblockdev_restore_work_t *works;
+	unsigned int nr_works, i;
+	struct file *file;
+	loff_t size, step;
+	int ret = 0;
+
+	file = domblockdev_snapshot_open(path, O_RDONLY);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+
+	size = min_t(loff_t, i_size_read(file_inode(file)), (loff_t)dev->capacity << SECTOR_SHIFT);
+	size = round_down(size, PAGE_SIZE);
+
+	// The old contents go first, restore only adds the pages the image has data for
+	ret = domblockdev_snapshot_zero(dev);
+	if (ret)
+		goto out_close;
+
+	// One range per CPU, each a multiple of 2 MB so extents are rarely split between workers
+	nr_works = max(1U, num_online_cpus());
+	step = round_up(DIV_ROUND_UP_ULL(size, nr_works), SZ_2M);
+	nr_works = size ? DIV_ROUND_UP_ULL(size, step) : 0;
+
+	works = kcalloc(max(1U, nr_works), sizeof(*works), GFP_KERNEL);
+	if (works == NULL) {
+		ret = -ENOMEM;
+		goto out_close;
+	}
+
+	for (i = 0; i < nr_works; i++) {
+		works[i].dev = dev;
+		works[i].file = file;
+		works[i].start = i * step;
+		works[i].end = min(size, (i + 1) * step);
+		INIT_WORK(&works[i].work, domblockdev_restore_work);
+		queue_work(system_unbound_wq, &works[i].work);
+	}
+	for (i = 0; i < nr_works; i++) {
+		flush_work(&works[i].work);
+		if (ret == 0)
+			ret = works[i].ret;
+	}
+
+	kfree(works);
+out_close:
+	filp_close(file, NULL);
+	return ret;
+}
+
+// sysfs: the value written is the path of the image file
+static ssize_t domblockdev_snapshot_store_attr(struct device *d, const char *buf, size_t count, bool restore) {
+	domblockdev_device_t* dev = dev_to_disk(d)->private_data;
+	char *path = kstrndup(buf, count, GFP_KERNEL);
+	int ret;
+
+	if (path == NULL)
+		return -ENOMEM;
+
+	// The image holds plain pages, compressed or shared entries would have to be unpacked first.
+	// In cache mode the backing file already is the image.
+	if (dev->comp || dev->dedup || dev->cache) {
+		kfree(path);
+		return -EOPNOTSUPP;
+	}
+	// A restore would leave every zone write pointer behind the data it brought back
+	if (restore && dev->zoned) {
+		kfree(path);
+		return -EOPNOTSUPP;
+	}
+
+	// No new opener gets in while we work, and a restore needs the disk closed to begin with.
+	// A snapshot doesn't, those who have the disk open keep going, so the queue is frozen:
+	// requests already in flight finish, new ones wait until the image is written.
+	mutex_lock(&dev->snapshot_lock);
+	if (restore && atomic_read(&dev->open_counter))
+		ret = -EBUSY;
+	else if (restore)
+		ret = domblockdev_snapshot_restore(dev, strim(path));
+	else {
+		blk_mq_freeze_queue(dev->queue);
+		ret = domblockdev_snapshot_save(dev, strim(path));
+		blk_mq_unfreeze_queue(dev->queue);
+	}
+	mutex_unlock(&dev->snapshot_lock);
+
+	if (ret)
+		printk(KERN_WARNING "domblockdev: %s of %s failed: %d\n", restore ? "Restore" : "Snapshot", strim(path), ret);
+	kfree(path);
+	return ret ? ret : count;
+}
+
+static ssize_t snapshot_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count) {
+	return domblockdev_snapshot_store_attr(d, buf, count, false);
+}
+static DEVICE_ATTR_WO(snapshot);
+
+static ssize_t restore_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count) {
+	return domblockdev_snapshot_store_attr(d, buf, count, true);
+}
+static DEVICE_ATTR_WO(restore);
+
+int domblockdev_snapshot_init(domblockdev_device_t* dev) {
+	int ret = device_create_file(disk_to_dev(dev->disk), &dev_attr_snapshot);
+	if (ret)
+		return ret;
+	ret = device_create_file(disk_to_dev(dev->disk), &dev_attr_restore);
+	if (ret)
+		device_remove_file(disk_to_dev(dev->disk), &dev_attr_snapshot);
+	return ret;
+}
+
+void domblockdev_snapshot_exit(domblockdev_device_t* dev) {
+	device_remove_file(disk_to_dev(dev->disk), &dev_attr_restore);
+	device_remove_file(disk_to_dev(dev->disk), &dev_attr_snapshot);
+}
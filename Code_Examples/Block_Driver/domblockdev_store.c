@@ -0,0 +1,316 @@
+// Page backed data store for the domblockdev ramdisk
+// The disk is an xarray of pages indexed by page offset, in the same way brd does it.
+// Nothing is allocated until a sector is written, and a missing page reads back as zeros,
+// so a multi-GB disk only costs as much memory as has actually been written to it.
+// Discard and write-zeroes give whole pages back. In compressed, dedup and cache mode every call is
+// handed to domblockdev_comp.c, domblockdev_dedup.c or domblockdev_cache.c, which keep their own
+// entries in the same xarray. Lookups and copies run under
+// rcu_read_lock() and pages are freed after a grace period, so a page can never go away
+// underneath a request that found it a moment earlier.
+
+#include <linux/highmem.h>
+#include <linux/mm.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+
+#include "domblockdev.h"
+
+void domblockdev_store_init(domblockdev_device_t* dev, sector_t capacity) {
+	dev->capacity = capacity;
+	xa_init(&dev->pages);
+	atomic_long_set(&dev->nr_pages, 0);
+	dev->numa_node = NUMA_NO_NODE;
+	nodes_clear(dev->interleave_nodes);
+}
+
+void domblockdev_store_free(domblockdev_device_t* dev) {
+	struct page *page;
+	unsigned long idx;
+
+	domblockdev_comp_free(dev); // take the entries with them in compressed and dedup mode
+	domblockdev_dedup_free(dev);
+	domblockdev_cache_free(dev);
+	xa_for_each(&dev->pages, idx, page) {
+		__free_page(page);
+		cond_resched();
+	}
+	xa_destroy(&dev->pages);
+	atomic_long_set(&dev->nr_pages, 0);
+	if (dev->node_pages) {
+		int node;
+		for (node = 0; node < nr_node_ids; node++)
+			atomic_long_set(&dev->node_pages[node], 0);
+	}
+	dev->capacity = 0;
+
+	// Wait for pages handed to call_rcu() by domblockdev_store_zero before the module goes away
+	rcu_barrier();
+}
+
+static void domblockdev_store_free_rcu(struct rcu_head *head) {
+	__free_page(container_of(head, struct page, rcu_head));
+}
+
+// Pick the node for the backing page at idx: a fixed node, round robin over the
+// interleave set, or (by default) the node of the CPU that writes it first
+int domblockdev_store_node(domblockdev_device_t* dev, pgoff_t idx) {
+	unsigned int nth;
+	int node;
+
+	if (dev->numa_node != NUMA_NO_NODE)
+		return dev->numa_node;
+	if (nodes_empty(dev->interleave_nodes))
+		return numa_node_id();
+
+	nth = idx % nodes_weight(dev->interleave_nodes);
+	node = first_node(dev->interleave_nodes);
+	while (nth--)
+		node = next_node(node, dev->interleave_nodes);
+	return node;
+}
+
+// Find the page backing sector, allocating it if it is not there yet.
+// We are called from queue_rq, which must not sleep, so allocation is GFP_NOWAIT and
+// the caller turns a failure into BLK_STS_RESOURCE to have blk-mq retry later.
+static struct page *domblockdev_store_insert(domblockdev_device_t* dev, sector_t sector) {
+	pgoff_t idx = sector >> DOMBLOCKDEV_PAGE_SECTORS_SHIFT;
+	struct page *page, *cur;
+
+	page = xa_load(&dev->pages, idx);
+	if (page)
+		return page;
+
+	page = alloc_pages_node(domblockdev_store_node(dev, idx), GFP_NOWAIT | __GFP_NOWARN | __GFP_ZERO | __GFP_HIGHMEM, 0);
+	if (page == NULL)
+		return NULL;
+
+	cur = xa_cmpxchg(&dev->pages, idx, NULL, page, GFP_NOWAIT | __GFP_NOWARN);
+	if (cur) {
+		// Somebody beat us to it, or the xarray could not allocate a node
+		__free_page(page);
+		return xa_is_err(cur) ? NULL : cur;
+	}
+
+	atomic_long_inc(&dev->nr_pages);
+	atomic_long_inc(&dev->node_pages[page_to_nid(page)]);
+	return page;
+}
+
+// Copy len bytes from page/offset to the disk at sector. len may span backing pages.
+int domblockdev_store_write(domblockdev_device_t* dev, sector_t sector, struct page *page, unsigned int offset, unsigned int len) {
+	int ret = 0;
+
+	if (dev->comp)
+		return domblockdev_comp_write(dev, sector, page, offset, len);
+	if (dev->dedup)
+		return domblockdev_dedup_write(dev, sector, page, offset, len);
+	if (dev->cache)
+		return domblockdev_cache_write(dev, sector, page, offset, len);
+
+	rcu_read_lock();
+	while (len) {
+		unsigned int pg_off = (sector & (DOMBLOCKDEV_PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+		unsigned int chunk = min_t(unsigned int, len, PAGE_SIZE - pg_off);
+		struct page *store = domblockdev_store_insert(dev, sector);
+		void *src, *dst;
+
+		if (store == NULL) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		src = kmap_atomic(page);
+		dst = kmap_atomic(store);
+		memcpy(dst + pg_off, src + offset, chunk);
+		kunmap_atomic(dst);
+		kunmap_atomic(src);
+
+		sector += chunk >> SECTOR_SHIFT;
+		offset += chunk;
+		len -= chunk;
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+// Copy len bytes from the disk at sector to page/offset. Unwritten sectors read as zeros.
+int domblockdev_store_read(domblockdev_device_t* dev, sector_t sector, struct page *page, unsigned int offset, unsigned int len) {
+	if (dev->comp)
+		return domblockdev_comp_read(dev, sector, page, offset, len);
+	if (dev->dedup)
+		return domblockdev_dedup_read(dev, sector, page, offset, len);
+	if (dev->cache)
+		return domblockdev_cache_read(dev, sector, page, offset, len);
+
+	rcu_read_lock();
+	while (len) {
+		unsigned int pg_off = (sector & (DOMBLOCKDEV_PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+		unsigned int chunk = min_t(unsigned int, len, PAGE_SIZE - pg_off);
+		struct page *store = xa_load(&dev->pages, sector >> DOMBLOCKDEV_PAGE_SECTORS_SHIFT);
+		void *dst = kmap_atomic(page);
+
+		if (store) {
+			void *src = kmap_atomic(store);
+			memcpy(dst + offset, src + pg_off, chunk);
+			kunmap_atomic(src);
+		}
+		else
+			memset(dst + offset, 0, chunk);
+		kunmap_atomic(dst);
+
+		sector += chunk >> SECTOR_SHIFT;
+		offset += chunk;
+		len -= chunk;
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+
+// Clear a range in place without freeing anything. Must be called under rcu_read_lock().
+static void domblockdev_store_clear(domblockdev_device_t* dev, sector_t sector, sector_t nr_sects) {
+	while (nr_sects) {
+		unsigned int pg_sect = sector & (DOMBLOCKDEV_PAGE_SECTORS - 1);
+		unsigned int chunk = min_t(sector_t, nr_sects, DOMBLOCKDEV_PAGE_SECTORS - pg_sect);
+		struct page *page = xa_load(&dev->pages, sector >> DOMBLOCKDEV_PAGE_SECTORS_SHIFT);
+
+		if (page) {
+			void *dst = kmap_atomic(page);
+			memset(dst + (pg_sect << SECTOR_SHIFT), 0, chunk << SECTOR_SHIFT);
+			kunmap_atomic(dst);
+		}
+
+		sector += chunk;
+		nr_sects -= chunk;
+	}
+}
+
+// Zero nr_sects sectors starting at sector. Pages that are covered completely are removed
+// from the store and freed, partially covered pages at either end are cleared in place.
+// Serves both REQ_OP_DISCARD and REQ_OP_WRITE_ZEROES, so discarded sectors also read as zeros.
+// It can't reschedule, so callers keep nr_sects small: DOMBLOCKDEV_MAX_DISCARD_SECTORS, or one zone
+// (which domblockdev_zoned_init keeps to that size as well).
+int domblockdev_store_zero(domblockdev_device_t* dev, sector_t sector, sector_t nr_sects) {
+	sector_t end = sector + nr_sects;
+	sector_t first = round_up(sector, DOMBLOCKDEV_PAGE_SECTORS);	// first whole page
+	sector_t last = round_down(end, DOMBLOCKDEV_PAGE_SECTORS);	// end of the last whole page
+	unsigned long idx, max;
+	struct page *page;
+
+	if (dev->comp)
+		return domblockdev_comp_zero(dev, sector, nr_sects);
+	if (dev->dedup)
+		return domblockdev_dedup_zero(dev, sector, nr_sects);
+	if (dev->cache) // no discard in cache mode, the file keeps its blocks
+		return -EOPNOTSUPP;
+
+	rcu_read_lock();
+	if (first >= last) {
+		domblockdev_store_clear(dev, sector, nr_sects);
+		rcu_read_unlock();
+		return 0;
+	}
+
+	domblockdev_store_clear(dev, sector, first - sector);
+	domblockdev_store_clear(dev, last, end - last);
+
+	// Only visit the pages that exist, a trim of a mostly empty disk is then nearly free
+	idx = first >> DOMBLOCKDEV_PAGE_SECTORS_SHIFT;
+	max = (last >> DOMBLOCKDEV_PAGE_SECTORS_SHIFT) - 1;
+	for (page = xa_find(&dev->pages, &idx, max, XA_PRESENT); page;
+	     page = xa_find_after(&dev->pages, &idx, max, XA_PRESENT)) {
+		page = xa_erase(&dev->pages, idx);
+		if (page == NULL) // a concurrent discard got there first
+			continue;
+		atomic_long_dec(&dev->nr_pages);
+		atomic_long_dec(&dev->node_pages[page_to_nid(page)]);
+		call_rcu(&page->rcu_head, domblockdev_store_free_rcu);
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+
+// Zero a range of a store that keeps its own entries in dev->pages, one disk page at a time.
+// zero_page clears sectors [pg_sect, pg_sect + nr) of the page at idx, and drops its entry when
+// that is the whole page. Only the pages that exist are visited, a trim of a mostly empty disk
+// is nearly free. The partial pages at either end must succeed, whole pages are best effort.
+int domblockdev_store_zero_pages(domblockdev_device_t* dev, sector_t sector, sector_t nr_sects,
+				 domblockdev_zero_page_fn zero_page) {
+	sector_t end = sector + nr_sects;
+	sector_t first = round_up(sector, DOMBLOCKDEV_PAGE_SECTORS);
+	sector_t last = round_down(end, DOMBLOCKDEV_PAGE_SECTORS);
+	unsigned long idx, max;
+	int ret = 0;
+
+	if (first >= last) // inside a single page, or straddling two
+		first = last = end;
+
+	while (ret == 0 && sector < first) {
+		unsigned int pg_sect = sector & (DOMBLOCKDEV_PAGE_SECTORS - 1);
+		unsigned int chunk = min_t(sector_t, first - sector, DOMBLOCKDEV_PAGE_SECTORS - pg_sect);
+
+		ret = zero_page(dev, sector >> DOMBLOCKDEV_PAGE_SECTORS_SHIFT, pg_sect, chunk);
+		sector += chunk;
+	}
+	if (ret == 0 && last < end)
+		ret = zero_page(dev, last >> DOMBLOCKDEV_PAGE_SECTORS_SHIFT, 0, end - last);
+	if (ret || first >= last)
+		return ret;
+
+	idx = first >> DOMBLOCKDEV_PAGE_SECTORS_SHIFT;
+	max = (last >> DOMBLOCKDEV_PAGE_SECTORS_SHIFT) - 1;
+	while (xa_find(&dev->pages, &idx, max, XA_PRESENT)) {
+		zero_page(dev, idx, 0, DOMBLOCKDEV_PAGE_SECTORS);
+		if (idx++ == max)
+			break;
+	}
+
+	return 0;
+}
+
+// Find the first run of present pages at or after *idx (up to max) and take a reference on
+// up to nr of them. *idx is set to the index of pages[0]. The caller may sleep while it holds
+// the references and drops them with put_page(); a concurrent discard only drops the store's own.
+unsigned int domblockdev_store_get_pages(domblockdev_device_t* dev, pgoff_t *idx, pgoff_t max, struct page **pages, unsigned int nr) {
+	unsigned long cur = *idx;
+	unsigned int n = 0;
+	struct page *page;
+
+	rcu_read_lock();
+	page = xa_find(&dev->pages, &cur, max, XA_PRESENT);
+	if (page) {
+		*idx = cur;
+		do {
+			get_page(page);
+			pages[n++] = page;
+			if (n == nr || cur == max)
+				break;
+			page = xa_load(&dev->pages, ++cur);
+		} while (page);
+	}
+	rcu_read_unlock();
+
+	return n;
+}
+
+// Put a filled page into the store at idx, for callers that may sleep. Replaces whatever was there.
+int domblockdev_store_add_page(domblockdev_device_t* dev, pgoff_t idx, struct page *page) {
+	struct page *old = xa_store(&dev->pages, idx, page, GFP_KERNEL);
+
+	if (xa_is_err(old))
+		return xa_err(old);
+
+	atomic_long_inc(&dev->nr_pages);
+	atomic_long_inc(&dev->node_pages[page_to_nid(page)]);
+	if (old) {
+		atomic_long_dec(&dev->nr_pages);
+		atomic_long_dec(&dev->node_pages[page_to_nid(old)]);
+		call_rcu(&old->rcu_head, domblockdev_store_free_rcu);
+	}
+	return 0;
+}
@@ -0,0 +1,91 @@
+// Tracepoints for the domblockdev ramdisk
+// These replace the printk calls that used to sit on the request path. A disabled
+// tracepoint is a single patched-out branch, so they cost nothing until you turn them on:
+//   echo 1 > /sys/kernel/debug/tracing/events/domblockdev/enable
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM domblockdev
+
+#if !defined(_DOMBLOCKDEV_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _DOMBLOCKDEV_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/blkdev.h>
+
+TRACE_EVENT(domblockdev_request,
+	TP_PROTO(struct request *rq, unsigned int hctx, unsigned int nr_bytes),
+	TP_ARGS(rq, hctx, nr_bytes),
+
+	TP_STRUCT__entry(
+		__field(sector_t, sector)
+		__field(unsigned int, nr_bytes)
+		__field(unsigned int, hctx)
+		__field(unsigned int, op)
+	),
+
+	TP_fast_assign(
+		__entry->sector = blk_rq_pos(rq);
+		__entry->nr_bytes = nr_bytes;
+		__entry->hctx = hctx;
+		__entry->op = req_op(rq);
+	),
+
+	TP_printk("hctx %u op %u sector %llu bytes %u",
+		  __entry->hctx, __entry->op,
+		  (unsigned long long)__entry->sector, __entry->nr_bytes)
+);
+
+DECLARE_EVENT_CLASS(domblockdev_disk_event,
+	TP_PROTO(struct gendisk *disk, int openers),
+	TP_ARGS(disk, openers),
+
+	TP_STRUCT__entry(
+		__array(char, disk_name, DISK_NAME_LEN)
+		__field(int, openers)
+	),
+
+	TP_fast_assign(
+		memcpy(__entry->disk_name, disk->disk_name, DISK_NAME_LEN);
+		__entry->openers = openers;
+	),
+
+	TP_printk("%s openers %d", __entry->disk_name, __entry->openers)
+);
+
+DEFINE_EVENT(domblockdev_disk_event, domblockdev_open,
+	TP_PROTO(struct gendisk *disk, int openers),
+	TP_ARGS(disk, openers)
+);
+
+DEFINE_EVENT(domblockdev_disk_event, domblockdev_release,
+	TP_PROTO(struct gendisk *disk, int openers),
+	TP_ARGS(disk, openers)
+);
+
+TRACE_EVENT(domblockdev_ioctl,
+	TP_PROTO(struct gendisk *disk, unsigned int cmd, int ret),
+	TP_ARGS(disk, cmd, ret),
+
+	TP_STRUCT__entry(
+		__array(char, disk_name, DISK_NAME_LEN)
+		__field(unsigned int, cmd)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		memcpy(__entry->disk_name, disk->disk_name, DISK_NAME_LEN);
+		__entry->cmd = cmd;
+		__entry->ret = ret;
+	),
+
+	TP_printk("%s cmd 0x%x ret %d", __entry->disk_name, __entry->cmd, __entry->ret)
+);
+
+#endif /* _DOMBLOCKDEV_TRACE_H */
+
+// This part must be outside the include guard
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE domblockdev_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,320 @@
+// Zoned block device emulation for the domblockdev ramdisk
+// With zoned=1 the disk is split into zone_size sequential write required zones, like a
+// host-managed SMR drive or a ZNS SSD. Each zone keeps a write pointer: a write must start
+// exactly at it, and a zone append lands wherever it currently is and tells the submitter
+// which sector that was. The write pointer is one atomic64 per zone, moved forward with
+// cmpxchg, so writes and appends from any number of queues never take a lock.
+// The zone condition is not stored for every write either. Empty, implicitly open and full
+// follow from the write pointer, and only explicit open and close are remembered in cond.
+// Zone management (reset, open, close, finish) is not ordered against writes that are still
+// in flight to the same zone, the same as on a real drive where the host has to wait for them.
+// Resetting all zones frees the whole disk, that is done by a work item and not in _queue_rq.
+
+#include <linux/blkdev.h>
+#include <linux/blkzoned.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/overflow.h>
+#include <linux/moduleparam.h>
+#include <linux/workqueue.h>
+#include <linux/llist.h>
+#include <linux/version.h>
+
+#include "domblockdev.h"
+
+static char *zone_size = "4M";
+module_param(zone_size, charp, S_IRUGO);
+MODULE_PARM_DESC(zone_size, "Zone size, a power of two with optional K/M/G suffix, at most 32M");
+
+static unsigned int zone_count = 0;
+module_param(zone_count, uint, S_IRUGO);
+MODULE_PARM_DESC(zone_count, "Number of zones, sets the disk size (0 = as many as fit in capacity)");
+
+typedef struct domblockdev_zone_s {
+	atomic64_t wp;		// Next sector to write, the zone end once it is full
+	atomic_t cond;		// BLK_ZONE_COND_EXP_OPEN or BLK_ZONE_COND_CLOSED if set by a zone command, else 0
+} ____cacheline_aligned_in_smp domblockdev_zone_t;	// appends to neighbouring zones should not share a line
+
+struct domblockdev_zoned_s {
+	sector_t zone_sectors;
+	unsigned int zone_shift;
+	unsigned int nr_zones;
+	struct llist_head reset_all_list;	// REQ_OP_ZONE_RESET_ALL requests waiting for reset_all_work
+	struct work_struct reset_all_work;
+	domblockdev_zone_t zones[];
+};
+
+static sector_t domblockdev_zone_start(domblockdev_zoned_t *zd, unsigned int i) {
+	return (sector_t)i << zd->zone_shift;
+}
+
+static unsigned char domblockdev_zone_cond(domblockdev_zoned_t *zd, unsigned int i) {
+	domblockdev_zone_t *zone = &zd->zones[i];
+	sector_t start = domblockdev_zone_start(zd, i);
+	sector_t wp = atomic64_read(&zone->wp);
+	int cond = atomic_read(&zone->cond);
+
+	if (wp >= start + zd->zone_sectors)
+		return BLK_ZONE_COND_FULL;
+	if (cond)
+		return cond;
+	return wp == start ? BLK_ZONE_COND_EMPTY : BLK_ZONE_COND_IMP_OPEN;
+}
+
+// Claim the sectors of a write or zone append. For a zone append the request is moved to
+// the sector it got, which blk-mq hands back to the submitter when the request completes.
+// The claim comes before the copy, an append can't know where its data goes otherwise, so
+// a copy that runs out of memory has to undo it with domblockdev_zoned_unclaim.
+int domblockdev_zoned_write(domblockdev_device_t* dev, struct request *rq) {
+	domblockdev_zoned_t *zd = dev->zoned;
+	sector_t sector = blk_rq_pos(rq);
+	unsigned int nr = blk_rq_sectors(rq);
+	unsigned int i = sector >> zd->zone_shift;
+	domblockdev_zone_t *zone;
+	sector_t end;
+	s64 wp, old;
+
+	if (i >= zd->nr_zones)
+		return -EIO;
+	zone = &zd->zones[i];
+	end = domblockdev_zone_start(zd, i) + zd->zone_sectors;
+
+	wp = atomic64_read(&zone->wp);
+	for (;;) {
+		if (wp + nr > end)
+			return -EIO; // full, or the write does not fit in what is left
+#ifdef DOMBLOCKDEV_HAVE_ZONE_APPEND
+		if (req_op(rq) != REQ_OP_ZONE_APPEND && wp != sector)
+#else
+		if (wp != sector)
+#endif
+			return -EIO; // not at the write pointer
+		old = atomic64_cmpxchg(&zone->wp, wp, wp + nr);
+		if (old == wp)
+			break;
+		wp = old;
+	}
+
+	// A write reopens a closed zone implicitly, an explicitly opened one stays that way
+	if (unlikely(atomic_read(&zone->cond) == BLK_ZONE_COND_CLOSED))
+		atomic_cmpxchg(&zone->cond, BLK_ZONE_COND_CLOSED, 0);
+
+#ifdef DOMBLOCKDEV_HAVE_ZONE_APPEND
+	if (req_op(rq) == REQ_OP_ZONE_APPEND)
+		rq->__sector = wp;
+#endif
+	return 0;
+}
+
+// Give back the sectors domblockdev_zoned_write claimed for rq, so blk-mq can retry it after
+// the copy ran out of memory. That only works while nobody has claimed sectors behind it: a
+// plain write is alone in its zone (mq-deadline), but an append may have been overtaken. Then
+// the request has to fail instead, a retry would claim a second range. Sectors the copy did
+// get to are past the write pointer again, the retry overwrites them.
+bool domblockdev_zoned_unclaim(domblockdev_device_t* dev, struct request *rq) {
+	domblockdev_zoned_t *zd = dev->zoned;
+	sector_t start = blk_rq_pos(rq);
+	domblockdev_zone_t *zone = &zd->zones[start >> zd->zone_shift];
+	s64 end = start + blk_rq_sectors(rq);
+
+	return atomic64_cmpxchg(&zone->wp, end, start) == end;
+}
+
+static int domblockdev_zone_reset(domblockdev_device_t* dev, unsigned int i) {
+	domblockdev_zoned_t *zd = dev->zoned;
+	domblockdev_zone_t *zone = &zd->zones[i];
+	sector_t start = domblockdev_zone_start(zd, i);
+
+	if (atomic64_read(&zone->wp) == start && atomic_read(&zone->cond) == 0)
+		return 0; // already empty, nothing to give back
+	atomic64_set(&zone->wp, start);
+	atomic_set(&zone->cond, 0);
+	return domblockdev_store_zero(dev, start, zd->zone_sectors);
+}
+
+static void domblockdev_zoned_reset_all_work(struct work_struct *work) {
+	domblockdev_zoned_t *zd = container_of(work, domblockdev_zoned_t, reset_all_work);
+	struct llist_node *list = llist_del_all(&zd->reset_all_list);
+	domblockdev_cmd_t *cmd, *next;
+
+	llist_for_each_entry_safe(cmd, next, llist_reverse_order(list), node) {
+		struct request *rq = blk_mq_rq_from_pdu(cmd);
+		domblockdev_queue_t *q = rq->mq_hctx->driver_data;
+		unsigned int i;
+		int ret = 0;
+
+		for (i = 0; i < zd->nr_zones && ret == 0; i++) {
+			ret = domblockdev_zone_reset(q->dev, i);
+			cond_resched();
+		}
+		if (ret)
+			atomic64_inc(&q->errors);
+		cmd->status = errno_to_blk_status(ret);
+		domblockdev_complete(q, rq);
+	}
+}
+
+// REQ_OP_ZONE_RESET_ALL, after _queue_rq has accounted for it. Resetting every zone frees the
+// whole disk, far more than _queue_rq may do under rcu_read_lock without rescheduling. So the
+// work item does it one zone at a time and completes the request when all of them are empty.
+void domblockdev_zoned_reset_all(domblockdev_queue_t *q, struct request *rq) {
+	domblockdev_zoned_t *zd = q->dev->zoned;
+
+	llist_add(&((domblockdev_cmd_t *)blk_mq_rq_to_pdu(rq))->node, &zd->reset_all_list);
+	queue_work(system_unbound_wq, &zd->reset_all_work);
+}
+
+// REQ_OP_ZONE_RESET and friends, except REQ_OP_ZONE_RESET_ALL
+int domblockdev_zoned_mgmt(domblockdev_device_t* dev, struct request *rq) {
+	domblockdev_zoned_t *zd = dev->zoned;
+	unsigned int i = blk_rq_pos(rq) >> zd->zone_shift;
+	domblockdev_zone_t *zone;
+	unsigned char cond;
+
+	if (i >= zd->nr_zones)
+		return -EIO;
+	zone = &zd->zones[i];
+	cond = domblockdev_zone_cond(zd, i);
+
+	switch (req_op(rq)) {
+	case REQ_OP_ZONE_RESET:
+		return domblockdev_zone_reset(dev, i);
+#ifdef DOMBLOCKDEV_HAVE_ZONE_MGMT
+	case REQ_OP_ZONE_OPEN:
+		if (cond != BLK_ZONE_COND_FULL)
+			atomic_set(&zone->cond, BLK_ZONE_COND_EXP_OPEN);
+		return 0;
+	case REQ_OP_ZONE_CLOSE:
+		// Closing a zone that was never written to leaves it empty
+		if (cond == BLK_ZONE_COND_IMP_OPEN || cond == BLK_ZONE_COND_EXP_OPEN)
+			atomic_set(&zone->cond, atomic64_read(&zone->wp) == domblockdev_zone_start(zd, i) ? 0 : BLK_ZONE_COND_CLOSED);
+		return 0;
+	case REQ_OP_ZONE_FINISH:
+		atomic64_set(&zone->wp, domblockdev_zone_start(zd, i) + zd->zone_sectors);
+		atomic_set(&zone->cond, 0);
+		return 0;
+#endif
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static void domblockdev_zone_fill(domblockdev_zoned_t *zd, unsigned int i, struct blk_zone *blkz) {
+	memset(blkz, 0, sizeof(*blkz));
+	blkz->start = domblockdev_zone_start(zd, i);
+	blkz->len = zd->zone_sectors;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+	blkz->capacity = zd->zone_sectors;
+#endif
+	blkz->wp = atomic64_read(&zd->zones[i].wp);
+	blkz->type = BLK_ZONE_TYPE_SEQWRITE_REQ;
+	blkz->cond = domblockdev_zone_cond(zd, i);
+}
+
+// block_device_operations.report_zones, the callback form arrived in 5.5
+int domblockdev_zoned_report(DOMBLOCKDEV_REPORT_ZONES_ARGS) {
+	domblockdev_device_t* dev = disk->private_data;
+	domblockdev_zoned_t *zd = dev->zoned;
+	unsigned int first, i, nr = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+	struct blk_zone blkz;
+	int ret;
+#endif
+
+	if (zd == NULL)
+		return -EOPNOTSUPP;
+	first = sector >> zd->zone_shift;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+	for (i = first; i < zd->nr_zones && nr < nr_zones; i++, nr++) {
+		domblockdev_zone_fill(zd, i, &blkz);
+		ret = cb(&blkz, i, data);
+		if (ret)
+			return ret;
+	}
+	return nr;
+#else
+	for (i = first; i < zd->nr_zones && nr < *nr_zones; i++, nr++)
+		domblockdev_zone_fill(zd, i, &zones[nr]);
+	*nr_zones = nr;
+	return 0;
+#endif
+}
+
+// Work out the zone layout before the queue and disk exist, with zoned=1. May shrink dev->capacity to whole zones.
+int domblockdev_zoned_init(domblockdev_device_t* dev) {
+	unsigned long long bytes;
+	domblockdev_zoned_t *zd;
+	sector_t zone_sectors;
+	unsigned int nr_zones, i;
+
+	bytes = memparse(zone_size, NULL);
+	if (!is_power_of_2(bytes) || bytes < PAGE_SIZE) {
+		printk(KERN_WARNING "domblockdev: Invalid zone_size \"%s\"\n", zone_size);
+		return -EINVAL;
+	}
+	zone_sectors = bytes >> SECTOR_SHIFT;
+	// A zone reset zeroes the zone from _queue_rq, which can't reschedule
+	if (zone_sectors > DOMBLOCKDEV_MAX_DISCARD_SECTORS) {
+		printk(KERN_WARNING "domblockdev: zone_size \"%s\" is too big, the most is %uM\n", zone_size,
+		       DOMBLOCKDEV_MAX_DISCARD_SECTORS >> (20 - SECTOR_SHIFT));
+		return -EINVAL;
+	}
+	nr_zones = zone_count ? zone_count : dev->capacity / zone_sectors;
+	if (nr_zones == 0) {
+		printk(KERN_WARNING "domblockdev: capacity is smaller than one zone\n");
+		return -EINVAL;
+	}
+
+	zd = kvzalloc(struct_size(zd, zones, nr_zones), GFP_KERNEL);
+	if (zd == NULL)
+		return -ENOMEM;
+	zd->zone_sectors = zone_sectors;
+	zd->zone_shift = ilog2(zone_sectors);
+	zd->nr_zones = nr_zones;
+	init_llist_head(&zd->reset_all_list);
+	INIT_WORK(&zd->reset_all_work, domblockdev_zoned_reset_all_work);
+	for (i = 0; i < nr_zones; i++)
+		atomic64_set(&zd->zones[i].wp, domblockdev_zone_start(zd, i));
+
+	dev->capacity = (sector_t)nr_zones * zone_sectors;
+	dev->zoned = zd;
+	return 0;
+}
+
+// Tell the block layer about the zones. Called once the disk has its queue and capacity, before add_disk.
+int domblockdev_zoned_setup(domblockdev_device_t* dev) {
+	domblockdev_zoned_t *zd = dev->zoned;
+	struct request_queue *queue = dev->queue;
+
+	if (zd == NULL)
+		return 0;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+	blk_queue_set_zoned(dev->disk, BLK_ZONED_HM);
+#else
+	queue->limits.zoned = BLK_ZONED_HM;
+#endif
+	blk_queue_flag_set(QUEUE_FLAG_ZONE_RESETALL, queue);
+	blk_queue_chunk_sectors(queue, zd->zone_sectors); // no request may cross a zone boundary
+#ifdef DOMBLOCKDEV_HAVE_ZONE_APPEND
+	blk_queue_max_zone_append_sectors(queue, zd->zone_sectors);
+	// Plain writes have to reach us in order, mq-deadline takes a write lock per zone for that
+	blk_queue_required_elevator_features(queue, ELEVATOR_F_ZBD_SEQ_WRITE);
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+	return blk_revalidate_disk_zones(dev->disk, NULL);
+#else
+	return blk_revalidate_disk_zones(dev->disk);
+#endif
+}
+
+// After the queue is gone, every reset all has been completed by then
+void domblockdev_zoned_free(domblockdev_device_t* dev) {
+	if (dev->zoned)
+		flush_work(&dev->zoned->reset_all_work); // may still be on its way out of the last one
+	kvfree(dev->zoned);
+	dev->zoned = NULL;
+}
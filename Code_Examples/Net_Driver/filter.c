@@ -1,4 +1,21 @@
 // Kernel module that blocks/allows tcp connections
+// Besides the global block/allow switch there is a rule table, filled through ioctls on the
+// char device (see filter.h). A rule matches a destination address, or an address and port,
+// and its action overrides the switch. The rules live in an rhashtable: the hook looks them up
+// under RCU without taking a lock, the table grows with the number of rules so a lookup stays
+// O(1), and the ioctls add and remove rules while packets keep flowing.
+// Rules for whole networks are CIDR prefixes, matched longest prefix first by the trie in
+// filter_lpm.c. They cover IPv6 as well, so a second hook watches IPv6 traffic for them.
+// IOCTL_FILTER_LOAD replaces the whole list at once: the new rules are built off to the side and
+// swapped in with one RCU pointer, each swap gets a new version number.
+// With ingress=1 incoming packets are filtered too, as early as netfilter gets to see them.
+// Outgoing TCP connections are decided at their SYN, filter_flow.c remembers the verdict so the
+// rest of the connection skips the rules.
+// Every packet is counted, globally in per-CPU counters and in plain atomics for the exact rule
+// it hit. They are read with an ioctl or from /proc/net/domnetfilter.
+// Each network namespace has its own rules, mode and counters (struct dom_net). The hooks are
+// only registered in a namespace once it has something to filter, until then a new namespace
+// costs the module nothing but a few zeroed bytes.
 
 #include <linux/kernel.h>
 #include <linux/sched.h>
@@ -8,22 +25,68 @@
 #include <linux/cdev.h>
 #include <linux/netfilter.h>
 #include <linux/netfilter_ipv4.h>
+#include <linux/netfilter_ipv6.h>
 #include <linux/net.h>
 #include <linux/in.h>
 #include <linux/skbuff.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
 #include <linux/tcp.h>
 #include <linux/device.h>
+#include <linux/udp.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/rhashtable.h>
+#include <linux/jump_label.h>
+#include <linux/ratelimit.h>
+#include <linux/string.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
+#include <linux/overflow.h>
+#include <linux/nsproxy.h>
+#include <linux/capability.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
 
 #include <asm/uaccess.h>
 #include <asm/atomic.h>
 #include <asm/ioctl.h>
 
-#define IOCTL_FILTER_ADDRESS	_IOW('k', 1, unsigned int) // Used for creating the ioctl command number
+#include "filter.h"
+#include "filter_lpm.h"
+#include "filter_flow.h"
 
-static char *toggle_string = "no_block";
-module_param(toggle_string, charp, 0000);
-MODULE_PARM_DESC(toggle_string, "Toggle Blocker on/off");
+#define CREATE_TRACE_POINTS
+#include "filter_trace.h"
+
+// What happens to packets no rule matches is decided per namespace (dom_net->mode). The hook
+// only gets to look at it when dom_block_any, a static key, is on: as long as no namespace
+// blocks, allowing everything is a patched-out branch instead of a compare per packet. The key
+// counts the namespaces in block mode, it and every dom_net->mode change under dom_mode_lock.
+static DEFINE_STATIC_KEY_FALSE(dom_block_any);
+static DEFINE_MUTEX(dom_mode_lock);
+
+// toggle_string is the mode of the initial namespace. Set at insmod it is only remembered here,
+// domnet_init applies it once the namespaces are set up. Both under dom_toggle_lock.
+static enum dom_filter_mode dom_init_mode = DOM_FILTER_MODE_ALLOW;
+static bool dom_ready;
+static DEFINE_MUTEX(dom_toggle_lock);
+
+static int dom_toggle_set(const char *val, const struct kernel_param *kp);
+static int dom_toggle_get(char *buffer, const struct kernel_param *kp);
+
+static const struct kernel_param_ops dom_toggle_ops = {
+	.set = dom_toggle_set,
+	.get = dom_toggle_get,
+};
+module_param_cb(toggle_string, &dom_toggle_ops, NULL, 0644);
+MODULE_PARM_DESC(toggle_string, "Toggle Blocker on/off: block or no_block");
+
+// At most this many SYNs per second reach the trace buffer, a SYN flood shouldn't flood it too
+static DEFINE_RATELIMIT_STATE(dom_syn_ratelimit, HZ, 100);
 
 static int dom_netfilter_open(struct inode *inode, struct file *file);
 static int dom_netfilter_release(struct inode *inode, struct file *file);
@@ -37,72 +100,1061 @@ static const struct file_operations fops = {
 };
 
 static unsigned int dom_netfilter_hookfn(void *priv, struct sk_buff *skb, const struct nf_hook_state *state);
+static unsigned int dom_netfilter_hookfn6(void *priv, struct sk_buff *skb, const struct nf_hook_state *state);
+static unsigned int dom_netfilter_hookfn_in(void *priv, struct sk_buff *skb, const struct nf_hook_state *state);
+static unsigned int dom_netfilter_hookfn6_in(void *priv, struct sk_buff *skb, const struct nf_hook_state *state);
+
+static bool ingress;
+module_param(ingress, bool, 0444);
+MODULE_PARM_DESC(ingress, "Also filter incoming packets, matching rules against their source");
+
+// The most a single IOCTL_FILTER_LOAD takes, of rules and of prefixes each. Both arrays are copied
+// into the kernel before the new table is built from them, so this bounds what one load can pin.
+static unsigned int max_load = 65536;
+module_param(max_load, uint, 0644);
+MODULE_PARM_DESC(max_load, "Most rules, and most prefixes, one IOCTL_FILTER_LOAD may carry");
+
+static struct nf_hook_ops net_nfho[] = {
+	{
+		.hook        = dom_netfilter_hookfn,
+		.hooknum     = NF_INET_LOCAL_OUT,
+		.pf          = PF_INET,
+		.priority    = NF_IP_PRI_FIRST
+	},
+	{
+		.hook        = dom_netfilter_hookfn6,
+		.hooknum     = NF_INET_LOCAL_OUT,
+		.pf          = PF_INET6,
+		.priority    = NF_IP6_PRI_FIRST
+	}
+};
 
-static struct nf_hook_ops net_nfho = {
-	.hook        = dom_netfilter_hookfn,
-	.hooknum     = NF_INET_LOCAL_OUT,
-	.pf          = PF_INET,
-	.priority    = NF_IP_PRI_FIRST
+// PRE_ROUTING at the first priority runs before defragmentation, conntrack and routing, so a
+// blocked packet costs as little as it can once it is an skb
+static struct nf_hook_ops net_nfho_in[] = {
+	{
+		.hook        = dom_netfilter_hookfn_in,
+		.hooknum     = NF_INET_PRE_ROUTING,
+		.pf          = PF_INET,
+		.priority    = NF_IP_PRI_FIRST
+	},
+	{
+		.hook        = dom_netfilter_hookfn6_in,
+		.hooknum     = NF_INET_PRE_ROUTING,
+		.pf          = PF_INET6,
+		.priority    = NF_IP6_PRI_FIRST
+	}
 };
 
 static struct cdev dom_cdev;
 static int dev_major = 0;
-static atomic_t ioctl_set;
-static unsigned int ioctl_set_addr;
+
+// Packet counters. The hook only adds to its own CPU's copy, so counting is a few increments that
+// never bounce a cache line between CPUs. A reset doesn't touch the per-CPU copies (that would
+// race with the hook and lose packets): it remembers the sums in base and later reads subtract
+// them. base is only used under the dom_net lock.
+struct dom_stats {
+	struct dom_filter_counters __percpu *pcpu;
+	struct dom_filter_counters base;
+};
+
+static int dom_stats_init(struct dom_stats *s) {
+	memset(&s->base, 0, sizeof(s->base));
+	s->pcpu = alloc_percpu(struct dom_filter_counters);
+	return s->pcpu ? 0 : -ENOMEM;
+}
+
+static void dom_stats_free(struct dom_stats *s) {
+	free_percpu(s->pcpu);
+}
+
+// Called from the hooks, which may be preempted, so only this_cpu ops
+static inline void dom_stats_count(struct dom_stats *s, unsigned int len, bool syn, unsigned int verdict) {
+	this_cpu_inc(s->pcpu->packets);
+	this_cpu_add(s->pcpu->bytes, len);
+	if (syn)
+		this_cpu_inc(s->pcpu->syns);
+	if (verdict == NF_DROP)
+		this_cpu_inc(s->pcpu->drops);
+	else
+		this_cpu_inc(s->pcpu->accepts);
+}
+
+// The counts since the last reset, and with reset start over from here. A packet counted while
+// the CPUs are summed up lands either in this read or in the next, never in both or neither.
+static void dom_stats_read(struct dom_stats *s, struct dom_filter_counters *out, bool reset) {
+	struct dom_filter_counters sum = {};
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct dom_filter_counters *c = per_cpu_ptr(s->pcpu, cpu);
+
+		sum.packets += READ_ONCE(c->packets);
+		sum.bytes += READ_ONCE(c->bytes);
+		sum.syns += READ_ONCE(c->syns);
+		sum.drops += READ_ONCE(c->drops);
+		sum.accepts += READ_ONCE(c->accepts);
+	}
+	out->packets = sum.packets - s->base.packets;
+	out->bytes = sum.bytes - s->base.bytes;
+	out->syns = sum.syns - s->base.syns;
+	out->drops = sum.drops - s->base.drops;
+	out->accepts = sum.accepts - s->base.accepts;
+	if (reset)
+		s->base = sum;
+}
+
+// Per rule counters. Per-CPU copies would cost every rule 40 bytes times the number of CPUs,
+// which adds up to gigabytes for a big rule list on a big machine, so a rule counts in plain
+// atomics instead. Only CPUs hitting the same rule share a cache line. A reset swaps each
+// counter with zero, so a packet lands in this read or the next one.
+struct dom_rule_counters {
+	atomic64_t packets;
+	atomic64_t bytes;
+	atomic64_t syns;
+	atomic64_t drops;
+	atomic64_t accepts;
+};
+
+static inline void dom_rule_count(struct dom_rule_counters *c, unsigned int len, bool syn, unsigned int verdict) {
+	atomic64_inc(&c->packets);
+	atomic64_add(len, &c->bytes);
+	if (syn)
+		atomic64_inc(&c->syns);
+	if (verdict == NF_DROP)
+		atomic64_inc(&c->drops);
+	else
+		atomic64_inc(&c->accepts);
+}
+
+static inline u64 dom_rule_counter(atomic64_t *v, bool reset) {
+	return reset ? atomic64_xchg(v, 0) : atomic64_read(v);
+}
+
+static void dom_rule_read(struct dom_rule_counters *c, struct dom_filter_counters *out, bool reset) {
+	out->packets = dom_rule_counter(&c->packets, reset);
+	out->bytes = dom_rule_counter(&c->bytes, reset);
+	out->syns = dom_rule_counter(&c->syns, reset);
+	out->drops = dom_rule_counter(&c->drops, reset);
+	out->accepts = dom_rule_counter(&c->accepts, reset);
+}
+
+// What a rule is looked up by. Padding is part of the hash, so keys are always zeroed first.
+struct dom_rule_key {
+	__be32 daddr;
+	__be16 dport;
+	u16 pad;
+};
+
+struct dom_rule {
+	struct rhash_head node;
+	struct dom_rule_key key;
+	u8 action;			// changed in place, so the counters survive a new action
+	struct dom_rule_counters stats;
+	struct rcu_head rcu;
+};
+
+static const struct rhashtable_params dom_rule_params = {
+	.key_len = sizeof(struct dom_rule_key),
+	.key_offset = offsetof(struct dom_rule, key),
+	.head_offset = offsetof(struct dom_rule, node),
+	.automatic_shrinking = true,
+};
+
+// Everything the hooks match packets against. Single rules and prefixes are changed in the live
+// ruleset. IOCTL_FILTER_LOAD builds a complete new one off to the side instead and swaps it in
+// with one pointer, so a packet sees either the old list or the new one, never half of each.
+struct dom_ruleset {
+	struct rhashtable rules;
+	struct dom_prefix_set __rcu *prefixes;	// replaced as a whole, see dom_prefix_publish
+	u64 version;				// bumped by every change
+};
+
+// Everything the module keeps for one network namespace. Until dom_net_activate this is all of
+// it: no ruleset, no counters, no hooks and no /proc file, so the hundredth container that never
+// gets a rule costs nothing per packet and next to nothing in memory.
+struct dom_net {
+	struct net *net;
+	struct mutex lock;			// Serializes the changes to this namespace, lookups don't take it
+	bool active;				// under lock, stays true until the namespace goes away
+	struct dom_ruleset __rcu *ruleset;	// set while active
+	struct dom_stats out_stats;		// outgoing packets, while active
+	struct dom_stats in_stats;
+	enum dom_filter_mode mode;		// under dom_mode_lock
+	atomic_long_t flow_gen;			// see dom_flow_gen
+	atomic_t ioctl_set;
+	unsigned int ioctl_set_addr;
+};
+
+static unsigned int dom_net_id;
+
+static inline struct dom_net *dom_net(const struct net *net) {
+	return net_generic(net, dom_net_id);
+}
+
+// NULL if the namespace has nothing to filter yet
+static struct dom_ruleset *dom_ruleset_locked(struct dom_net *dn) {
+	return rcu_dereference_protected(dn->ruleset, lockdep_is_held(&dn->lock));
+}
+
+// Find the rule for a packet to daddr:dport, a rule for the port wins over one for the whole address.
+// dport is 0 for protocols without ports. Called from the hook, which runs under rcu_read_lock.
+static struct dom_rule *dom_rule_lookup(struct dom_ruleset *rs, __be32 daddr, __be16 dport) {
+	struct dom_rule_key key = { .daddr = daddr, .dport = dport };
+	struct dom_rule *rule = NULL;
+
+	if (dport)
+		rule = rhashtable_lookup(&rs->rules, &key, dom_rule_params);
+	if (rule == NULL) {
+		key.dport = 0;
+		rule = rhashtable_lookup(&rs->rules, &key, dom_rule_params);
+	}
+	return rule;
+}
+
+static void dom_rule_free_rcu(struct rcu_head *head) {
+	kfree(container_of(head, struct dom_rule, rcu));
+}
+
+static void dom_rule_free(void *ptr, void *arg) {
+	kfree(ptr);
+}
+
+// Add r to rs, or change the action of the rule that is already there. rs is either the live
+// ruleset under its dom_net lock or a new one nobody else can see yet.
+static int dom_ruleset_add_rule(struct dom_ruleset *rs, const struct dom_filter_rule *r) {
+	struct dom_rule_key key = { .daddr = r->daddr, .dport = r->dport };
+	struct dom_rule *rule;
+	int err;
+
+	if (r->pad || (r->action != DOM_FILTER_ALLOW && r->action != DOM_FILTER_BLOCK))
+		return -EINVAL;
+
+	rule = rhashtable_lookup_fast(&rs->rules, &key, dom_rule_params);
+	if (rule) {
+		// A packet sees either the old action or the new one
+		WRITE_ONCE(rule->action, r->action);
+		return 0;
+	}
+
+	rule = kzalloc(sizeof(*rule), GFP_KERNEL);
+	if (rule == NULL)
+		return -ENOMEM;
+	rule->key = key;
+	rule->action = r->action;
+	err = rhashtable_insert_fast(&rs->rules, &rule->node, dom_rule_params);
+	if (err)
+		kfree(rule);
+	return err;
+}
+
+static int dom_net_activate(struct dom_net *dn);
+
+static int dom_rule_add(struct dom_net *dn, const struct dom_filter_rule *r) {
+	struct dom_ruleset *rs;
+	int err;
+
+	err = dom_net_activate(dn);
+	if (err)
+		return err;
+	mutex_lock(&dn->lock);
+	rs = dom_ruleset_locked(dn);
+	err = dom_ruleset_add_rule(rs, r);
+	if (err == 0) {
+		rs->version++;
+		dom_flow_invalidate(&dn->flow_gen);
+	}
+	mutex_unlock(&dn->lock);
+
+	return err;
+}
+
+static int dom_rule_del(struct dom_net *dn, const struct dom_filter_rule *r) {
+	struct dom_rule_key key = { .daddr = r->daddr, .dport = r->dport };
+	struct dom_ruleset *rs;
+	struct dom_rule *rule = NULL;
+	int err = -ENOENT;
+
+	mutex_lock(&dn->lock);
+	rs = dom_ruleset_locked(dn);
+	if (rs)
+		rule = rhashtable_lookup_fast(&rs->rules, &key, dom_rule_params);
+	if (rule) {
+		err = rhashtable_remove_fast(&rs->rules, &rule->node, dom_rule_params);
+		if (err == 0) {
+			rs->version++;
+			// Cached flows may still point at the rule, they go stale before it is freed
+			dom_flow_invalidate(&dn->flow_gen);
+			call_rcu(&rule->rcu, dom_rule_free_rcu);
+		}
+	}
+	mutex_unlock(&dn->lock);
+
+	return err;
+}
+
+// Read the counters of one rule, the action of r is ignored
+static int dom_rule_stats(struct dom_net *dn, const struct dom_filter_rule *r,
+			  struct dom_filter_counters *out, bool reset) {
+	struct dom_rule_key key = { .daddr = r->daddr, .dport = r->dport };
+	struct dom_ruleset *rs;
+	struct dom_rule *rule = NULL;
+	int err = -ENOENT;
+
+	mutex_lock(&dn->lock);
+	rs = dom_ruleset_locked(dn);
+	if (rs)
+		rule = rhashtable_lookup_fast(&rs->rules, &key, dom_rule_params);
+	if (rule) {
+		dom_rule_read(&rule->stats, out, reset);
+		err = 0;
+	}
+	mutex_unlock(&dn->lock);
+
+	return err;
+}
+
+// The prefix set is never changed in place either: an ioctl builds a new one next to it under
+// the dom_net lock, publishes it and frees the old one once no hook can still be using it.
+static void dom_prefix_publish(struct dom_net *dn, struct dom_ruleset *rs, struct dom_prefix_set *set) {
+	struct dom_prefix_set *old = rcu_dereference_protected(rs->prefixes, lockdep_is_held(&dn->lock));
+
+	rcu_assign_pointer(rs->prefixes, set);
+	rs->version++;
+	dom_flow_invalidate(&dn->flow_gen);
+	synchronize_rcu();
+	dom_prefix_set_free(old);
+}
+
+static int dom_prefix_change(struct dom_net *dn, const struct dom_filter_prefix *p, bool add) {
+	struct dom_filter_prefix *prefixes = NULL;
+	struct dom_prefix_set *old, *set;
+	struct dom_ruleset *rs;
+	unsigned int i, nr;
+	bool found = false;
+	int err = 0;
+
+	if (add) {
+		err = dom_net_activate(dn);
+		if (err)
+			return err;
+	}
+	mutex_lock(&dn->lock);
+	rs = dom_ruleset_locked(dn);
+	if (rs == NULL) {
+		err = -ENOENT;
+		goto out;
+	}
+	old = rcu_dereference_protected(rs->prefixes, lockdep_is_held(&dn->lock));
+	nr = dom_prefix_set_size(old);
+
+	prefixes = kvmalloc_array(nr + 1, sizeof(*prefixes), GFP_KERNEL);
+	if (prefixes == NULL) {
+		err = -ENOMEM;
+		goto out;
+	}
+	if (nr)
+		memcpy(prefixes, dom_prefix_set_prefixes(old), nr * sizeof(*prefixes));
+
+	for (i = 0; i < nr; i++) {
+		if (!dom_prefix_equal(&prefixes[i], p))
+			continue;
+		found = true;
+		if (add)
+			prefixes[i].action = p->action;
+		else
+			prefixes[i] = prefixes[--nr];
+		break;
+	}
+	if (!found) {
+		if (!add) {
+			err = -ENOENT;
+			goto out;
+		}
+		prefixes[nr++] = *p;
+	}
+
+	set = dom_prefix_set_build(prefixes, nr);
+	if (IS_ERR(set)) {
+		err = PTR_ERR(set);
+		goto out;
+	}
+	dom_prefix_publish(dn, rs, set);
+
+out:
+	mutex_unlock(&dn->lock);
+	kvfree(prefixes);
+	return err;
+}
+
+// The action of the longest prefix that covers daddr, or -1. Called under rcu_read_lock.
+static int dom_prefix_action4(struct dom_ruleset *rs, __be32 daddr) {
+	const struct dom_prefix_set *set = rcu_dereference(rs->prefixes);
+	const struct dom_filter_prefix *p;
+
+	if (set == NULL)
+		return -1;
+	p = dom_prefix_lookup4(set, daddr);
+	return p ? p->action : -1;
+}
+
+static struct dom_ruleset *dom_ruleset_alloc(unsigned int nr_rules) {
+	struct rhashtable_params params = dom_rule_params;
+	struct dom_ruleset *rs;
+	int err;
+
+	rs = kzalloc(sizeof(*rs), GFP_KERNEL);
+	if (rs == NULL)
+		return ERR_PTR(-ENOMEM);
+	// Start out big enough, rather than growing the table step by step while it is filled
+	params.nelem_hint = nr_rules;
+	err = rhashtable_init(&rs->rules, &params);
+	if (err) {
+		kfree(rs);
+		return ERR_PTR(err);
+	}
+	return rs;
+}
+
+// Only once no hook and no ioctl can see rs any more
+static void dom_ruleset_free(struct dom_ruleset *rs) {
+	rhashtable_free_and_destroy(&rs->rules, dom_rule_free, NULL);
+	dom_prefix_set_free(rcu_dereference_protected(rs->prefixes, 1));
+	kfree(rs);
+}
+
+// A rule that is in both the old and the new ruleset keeps counting where it left off. Called
+// after a grace period, when the old counters don't move any more.
+static void dom_ruleset_carry_stats(struct dom_ruleset *old, struct dom_ruleset *rs) {
+	struct rhashtable_iter iter;
+	struct dom_rule *rule, *now;
+	struct dom_filter_counters c;
+
+	rhashtable_walk_enter(&old->rules, &iter);
+	rhashtable_walk_start(&iter);
+	while ((rule = rhashtable_walk_next(&iter)) != NULL) {
+		if (IS_ERR(rule))
+			continue;
+		now = rhashtable_lookup_fast(&rs->rules, &rule->key, dom_rule_params);
+		if (now == NULL)
+			continue;
+		dom_rule_read(&rule->stats, &c, false);
+		atomic64_add(c.packets, &now->stats.packets);
+		atomic64_add(c.bytes, &now->stats.bytes);
+		atomic64_add(c.syns, &now->stats.syns);
+		atomic64_add(c.drops, &now->stats.drops);
+		atomic64_add(c.accepts, &now->stats.accepts);
+	}
+	rhashtable_walk_stop(&iter);
+	rhashtable_walk_exit(&iter);
+}
+
+// Replace every rule and prefix of a namespace at once. The new ruleset is built without holding
+// the dom_net lock, so packets and other ioctls carry on meanwhile. With check the load only goes
+// ahead if the live version is still *version. On success *version is the version of the new ruleset.
+static int dom_ruleset_load(struct dom_net *dn, const struct dom_filter_rule *rules, unsigned int nr_rules,
+			    struct dom_filter_prefix *prefixes, unsigned int nr_prefixes,
+			    u64 *version, bool check) {
+	struct dom_ruleset *rs, *old;
+	struct dom_prefix_set *set;
+	unsigned int i;
+	int err;
+
+	err = dom_net_activate(dn);
+	if (err)
+		return err;
+	rs = dom_ruleset_alloc(nr_rules);
+	if (IS_ERR(rs))
+		return PTR_ERR(rs);
+	for (i = 0; i < nr_rules && err == 0; i++)
+		err = dom_ruleset_add_rule(rs, &rules[i]);
+	for (i = 0; i < nr_prefixes && err == 0; i++)
+		err = dom_prefix_normalize(&prefixes[i]);
+	if (err == 0 && nr_prefixes) {
+		set = dom_prefix_set_build(prefixes, nr_prefixes);
+		if (IS_ERR(set))
+			err = PTR_ERR(set);
+		else
+			RCU_INIT_POINTER(rs->prefixes, set);
+	}
+	if (err) {
+		dom_ruleset_free(rs);
+		return err;
+	}
+
+	mutex_lock(&dn->lock);
+	old = dom_ruleset_locked(dn);
+	if (check && old->version != *version) {
+		mutex_unlock(&dn->lock);
+		dom_ruleset_free(rs);
+		return -ESTALE;
+	}
+	rs->version = old->version + 1;
+	rcu_assign_pointer(dn->ruleset, rs);
+	dom_flow_invalidate(&dn->flow_gen);
+	synchronize_rcu();
+	dom_ruleset_carry_stats(old, rs);
+	*version = rs->version;
+	mutex_unlock(&dn->lock);
+
+	dom_ruleset_free(old);
+	return 0;
+}
 
 // Test ioctl_set_addr if it has been set.
-static int test_daddr(unsigned int dst_addr) {
+static int test_daddr(struct dom_net *dn, unsigned int dst_addr) {
 	int ret = 0;
 
-	if (atomic_read(&ioctl_set) == 1)
-		ret = (ioctl_set_addr == dst_addr);
+	if (atomic_read(&dn->ioctl_set) == 1)
+		ret = (READ_ONCE(dn->ioctl_set_addr) == dst_addr);
 	else
 		ret = 1;
 		
 	return ret;
 }
 
+// Trace an outgoing SYN, if it goes to the address set with IOCTL_FILTER_ADDRESS
+static noinline void dom_trace_syn(struct dom_net *dn, const struct iphdr *iph, const struct tcphdr *tcph,
+				   unsigned int verdict) {
+	if (test_daddr(dn, iph->daddr) && __ratelimit(&dom_syn_ratelimit))
+		trace_domnetfilter_syn(iph->saddr, tcph->source, iph->daddr, tcph->dest, verdict);
+}
+
+// The verdict for a packet nobody has decided on yet. addr and port are the remote end, the
+// destination of an outgoing packet or the source of an incoming one.
+static unsigned int dom_netfilter_decide(struct dom_net *dn, __be32 addr, __be16 port, bool outgoing,
+					 struct dom_rule **rulep) {
+	struct dom_ruleset *rs = rcu_dereference(dn->ruleset);
+	struct dom_rule *rule = dom_rule_lookup(rs, addr, port);
+	int action;
+
+	*rulep = rule;
+	// what to do with the packets... a rule has the final say, then the longest matching prefix,
+	// the mode decides the rest
+	if (rule)
+		return READ_ONCE(rule->action) == DOM_FILTER_BLOCK ? NF_DROP : NF_ACCEPT;
+	action = dom_prefix_action4(rs, addr);
+	if (action >= 0)
+		return action == DOM_FILTER_BLOCK ? NF_DROP : NF_ACCEPT;
+	// toggle_string only ever blocked outgoing traffic
+	if (outgoing && static_branch_unlikely(&dom_block_any) && READ_ONCE(dn->mode) == DOM_FILTER_MODE_BLOCK)
+		return NF_DROP;
+	return NF_ACCEPT;
+}
+
 static unsigned int dom_netfilter_hookfn(void *priv, struct sk_buff *skb, const struct nf_hook_state *state) {
 	// get IP header
 	struct iphdr *iph = ip_hdr(skb);
+	struct dom_net *dn = dom_net(state->net);
+	unsigned long gen = dom_flow_gen(&dn->flow_gen); // before the rules are looked at, see dom_flow_insert
+	struct dom_rule *rule = NULL;
+	union {
+		__be16 ports[2];
+		struct tcphdr tcph;
+	} _th, *th = NULL;
+	struct dom_flow_key fk = {};
+	enum dom_flow_result cached = DOM_FLOW_MISS;
+	unsigned int verdict = NF_ACCEPT;
+	bool syn = false;
+	// Locally built packets are fragmented after this hook, but a raw IP_HDRINCL socket can hand
+	// us a later fragment. Its payload has no ports, like on the way in only the address counts.
+	bool first_frag = !(iph->frag_off & htons(IP_OFFSET));
 
-	if (iph->protocol == IPPROTO_TCP && test_daddr(iph->daddr)) {
-		// then get the TCP header
-		struct tcphdr *tcph = tcp_hdr(skb);
-		
-		// see if the packet was for initiation
-		if (tcph->syn && !tcph->ack) {
-			printk("domnetfilter: TCP connection initiated from " "%pI4:%u\n", &iph->saddr, ntohs(tcph->source));
-			if (!strcmp(toggle_string, "block"))
-				printk("domnetfilter: Packets being blocked!");
-			else
-				printk("domnetfilter: Packets allowed to pass!");
+	// source and destination port sit at the start of both the TCP and the UDP header
+	if (first_frag && iph->protocol == IPPROTO_TCP) {
+		th = skb_header_pointer(skb, iph->ihl * 4, sizeof(th->tcph), &_th);
+		if (th) {
+			syn = th->tcph.syn && !th->tcph.ack;
+			fk.net = state->net;
+			fk.saddr = iph->saddr;
+			fk.daddr = iph->daddr;
+			fk.sport = th->tcph.source;
+			fk.dport = th->tcph.dest;
+			// The rest of a connection goes the way its SYN went
+			if (!syn)
+				cached = dom_flow_lookup(&fk, gen, &rule, &verdict);
+		}
+	}
+	else if (first_frag && iph->protocol == IPPROTO_UDP)
+		th = skb_header_pointer(skb, iph->ihl * 4, sizeof(th->ports), &_th);
+
+	if (cached != DOM_FLOW_HIT) {
+		verdict = dom_netfilter_decide(dn, iph->daddr, th ? th->ports[1] : 0, true, &rule);
+		// Remember every TCP connection the cache doesn't know (yet, or any more after an eviction
+		// or a timeout), and refresh those the rules changed under. A connection that is closing
+		// isn't worth an entry.
+		if (fk.net && !th->tcph.fin && !th->tcph.rst)
+			dom_flow_insert(&fk, gen, rule, verdict);
+	}
+
+	dom_stats_count(&dn->out_stats, skb->len, syn, verdict);
+	if (rule)
+		dom_rule_count(&rule->stats, skb->len, syn, verdict);
+	if (syn && trace_domnetfilter_syn_enabled())
+		dom_trace_syn(dn, iph, &th->tcph, verdict);
+
+	return verdict;
+}
+
+// Incoming packets are matched by where they come from. They don't go through the flow cache:
+// the connections it knows are the outgoing ones, and a dropped packet should cost as little
+// as possible, not add an entry.
+static unsigned int dom_netfilter_hookfn_in(void *priv, struct sk_buff *skb, const struct nf_hook_state *state) {
+	struct iphdr *iph = ip_hdr(skb);
+	struct dom_net *dn = dom_net(state->net);
+	struct dom_rule *rule;
+	__be16 _ports[2], *ports = NULL;
+	unsigned int verdict;
+
+	// Defragmentation hasn't happened yet, only the first fragment has the ports
+	if ((iph->protocol == IPPROTO_TCP || iph->protocol == IPPROTO_UDP) && !(iph->frag_off & htons(IP_OFFSET)))
+		ports = skb_header_pointer(skb, iph->ihl * 4, sizeof(_ports), _ports);
+	verdict = dom_netfilter_decide(dn, iph->saddr, ports ? ports[0] : 0, false, &rule);
+
+	dom_stats_count(&dn->in_stats, skb->len, false, verdict);
+	if (rule)
+		dom_rule_count(&rule->stats, skb->len, false, verdict);
+	return verdict;
+}
+
+// IPv6 packets only answer to prefix rules, everything else passes like it always did
+static unsigned int dom_netfilter_verdict6(struct dom_net *dn, const struct in6_addr *addr) {
+	const struct dom_prefix_set *set = rcu_dereference(rcu_dereference(dn->ruleset)->prefixes);
+	const struct dom_filter_prefix *p = NULL;
+
+	if (set)
+		p = dom_prefix_lookup6(set, addr);
+	return p && p->action == DOM_FILTER_BLOCK ? NF_DROP : NF_ACCEPT;
+}
+
+static unsigned int dom_netfilter_hookfn6(void *priv, struct sk_buff *skb, const struct nf_hook_state *state) {
+	struct dom_net *dn = dom_net(state->net);
+	unsigned int verdict = dom_netfilter_verdict6(dn, &ipv6_hdr(skb)->daddr);
+
+	dom_stats_count(&dn->out_stats, skb->len, false, verdict);
+	return verdict;
+}
+
+static unsigned int dom_netfilter_hookfn6_in(void *priv, struct sk_buff *skb, const struct nf_hook_state *state) {
+	struct dom_net *dn = dom_net(state->net);
+	unsigned int verdict = dom_netfilter_verdict6(dn, &ipv6_hdr(skb)->saddr);
+
+	dom_stats_count(&dn->in_stats, skb->len, false, verdict);
+	return verdict;
+}
+
+static int dom_register_hooks(struct net *net) {
+	int err = nf_register_net_hooks(net, net_nfho, ARRAY_SIZE(net_nfho));
+
+	if (err || !ingress)
+		return err;
+	err = nf_register_net_hooks(net, net_nfho_in, ARRAY_SIZE(net_nfho_in));
+	if (err)
+		nf_unregister_net_hooks(net, net_nfho, ARRAY_SIZE(net_nfho));
+	return err;
+}
+
+static void dom_unregister_hooks(struct net *net) {
+	if (ingress)
+		nf_unregister_net_hooks(net, net_nfho_in, ARRAY_SIZE(net_nfho_in));
+	nf_unregister_net_hooks(net, net_nfho, ARRAY_SIZE(net_nfho));
+}
+
+// Changing the filter of a namespace takes CAP_NET_ADMIN in the user namespace that owns it, like
+// any other firewall change there. Reading counters only takes access to the device or the file.
+static bool dom_net_capable(const struct dom_net *dn) {
+	return ns_capable(dn->net->user_ns, CAP_NET_ADMIN);
+}
+
+// /proc/net/domnetfilter: the counters of the namespace and those of every rule in it. Writing
+// anything resets all of them. The flow cache is shared by all namespaces and its numbers count
+// every namespace's traffic, so only the initial namespace gets a flows line.
+static void dom_stats_show_counters(struct seq_file *m, const struct dom_filter_counters *c) {
+	seq_printf(m, "packets %llu bytes %llu syns %llu drops %llu accepts %llu\n",
+		   c->packets, c->bytes, c->syns, c->drops, c->accepts);
+}
+
+static int dom_stats_show(struct seq_file *m, void *v) {
+	struct dom_net *dn = dom_net(seq_file_single_net(m));
+	struct dom_filter_flow_stats fs;
+	struct dom_filter_counters c;
+	struct rhashtable_iter iter;
+	struct dom_rule *rule;
+
+	// The file only exists while the namespace is active
+	mutex_lock(&dn->lock);
+	seq_printf(m, "version %llu\n", dom_ruleset_locked(dn)->version);
+	dom_stats_read(&dn->out_stats, &c, false);
+	seq_puts(m, "out ");
+	dom_stats_show_counters(m, &c);
+	dom_stats_read(&dn->in_stats, &c, false);
+	seq_puts(m, "in ");
+	dom_stats_show_counters(m, &c);
+	if (net_eq(dn->net, &init_net)) {
+		dom_flow_stats(&fs);
+		seq_printf(m, "flows entries %llu capacity %llu hit_x100 %llu hits %llu misses %llu stale %llu evictions %llu expired %llu\n",
+			   fs.entries, fs.capacity, div64_u64(fs.hits * 100, max(fs.hits + fs.misses + fs.stale, 1ULL)),
+			   fs.hits, fs.misses, fs.stale, fs.evictions, fs.expired);
+	}
+
+	rhashtable_walk_enter(&dom_ruleset_locked(dn)->rules, &iter);
+	rhashtable_walk_start(&iter);
+	while ((rule = rhashtable_walk_next(&iter)) != NULL) {
+		if (IS_ERR(rule))
+			continue;
+		dom_rule_read(&rule->stats, &c, false);
+		seq_printf(m, "%pI4:%u %s ", &rule->key.daddr, ntohs(rule->key.dport),
+			   rule->action == DOM_FILTER_BLOCK ? "block" : "allow");
+		dom_stats_show_counters(m, &c);
+	}
+	rhashtable_walk_stop(&iter);
+	rhashtable_walk_exit(&iter);
+	mutex_unlock(&dn->lock);
+
+	return 0;
+}
+
+static int dom_stats_write(struct file *file, char *buf, size_t size) {
+	struct dom_net *dn = dom_net(seq_file_single_net(file->private_data));
+	struct dom_filter_counters c;
+	struct rhashtable_iter iter;
+	struct dom_rule *rule;
+
+	if (!dom_net_capable(dn))
+		return -EPERM;
+
+	mutex_lock(&dn->lock);
+	dom_stats_read(&dn->out_stats, &c, true);
+	dom_stats_read(&dn->in_stats, &c, true);
+	rhashtable_walk_enter(&dom_ruleset_locked(dn)->rules, &iter);
+	rhashtable_walk_start(&iter);
+	while ((rule = rhashtable_walk_next(&iter)) != NULL) {
+		if (!IS_ERR(rule))
+			dom_rule_read(&rule->stats, &c, true);
+	}
+	rhashtable_walk_stop(&iter);
+	rhashtable_walk_exit(&iter);
+	mutex_unlock(&dn->lock);
+
+	return 0;
+}
+
+// Give a namespace its ruleset, counters, hooks and /proc file, the first time it has something
+// to filter. Everything the hooks look at is in place before they are registered.
+static int dom_net_activate(struct dom_net *dn) {
+	struct dom_ruleset *rs;
+	int err = 0;
+
+	mutex_lock(&dn->lock);
+	if (dn->active)
+		goto out;
+
+	rs = dom_ruleset_alloc(0);
+	if (IS_ERR(rs)) {
+		err = PTR_ERR(rs);
+		goto out;
+	}
+	err = dom_stats_init(&dn->out_stats);
+	if (err)
+		goto free_rs;
+	err = dom_stats_init(&dn->in_stats);
+	if (err)
+		goto free_out;
+	RCU_INIT_POINTER(dn->ruleset, rs);
+
+	err = dom_register_hooks(dn->net);
+	if (err)
+		goto free_in;
+	if (!proc_create_net_single_write("domnetfilter", 0644, dn->net->proc_net, dom_stats_show, dom_stats_write, NULL)) {
+		err = -ENOMEM;
+		goto unregister;
+	}
+	dn->active = true;
+	goto out;
+
+unregister:
+	dom_unregister_hooks(dn->net);
+free_in:
+	RCU_INIT_POINTER(dn->ruleset, NULL);
+	dom_stats_free(&dn->in_stats);
+free_out:
+	dom_stats_free(&dn->out_stats);
+free_rs:
+	dom_ruleset_free(rs);
+out:
+	mutex_unlock(&dn->lock);
+	return err;
+}
+
+// Blocking needs the hooks, so it activates the namespace. Going back to allow leaves it active.
+static int dom_net_set_mode(struct dom_net *dn, enum dom_filter_mode mode) {
+	int err;
+
+	if (mode == DOM_FILTER_MODE_BLOCK) {
+		err = dom_net_activate(dn);
+		if (err)
+			return err;
+	}
+
+	mutex_lock(&dom_mode_lock);
+	if (dn->mode != mode) {
+		if (mode == DOM_FILTER_MODE_BLOCK)
+			static_branch_inc(&dom_block_any);
+		else
+			static_branch_dec(&dom_block_any);
+		WRITE_ONCE(dn->mode, mode);
+		dom_flow_invalidate(&dn->flow_gen);
+	}
+	mutex_unlock(&dom_mode_lock);
+	return 0;
+}
+
+// toggle_string is still the name of the switch, but it is parsed once when it is set, at insmod
+// or later through /sys/module/domnetfilter/parameters/toggle_string. It is the mode of the
+// initial namespace, the others are set with IOCTL_FILTER_SET_MODE.
+static int dom_toggle_set(const char *val, const struct kernel_param *kp) {
+	enum dom_filter_mode mode;
+	int err = 0;
+
+	if (sysfs_streq(val, "block"))
+		mode = DOM_FILTER_MODE_BLOCK;
+	else if (sysfs_streq(val, "no_block") || sysfs_streq(val, "allow"))
+		mode = DOM_FILTER_MODE_ALLOW;
+	else
+		return -EINVAL;
+
+	mutex_lock(&dom_toggle_lock);
+	if (dom_ready)
+		err = dom_net_set_mode(dom_net(&init_net), mode);
+	else
+		dom_init_mode = mode;
+	mutex_unlock(&dom_toggle_lock);
+	return err;
+}
+
+static int dom_toggle_get(char *buffer, const struct kernel_param *kp) {
+	enum dom_filter_mode mode;
+
+	mutex_lock(&dom_toggle_lock);
+	mode = dom_ready ? READ_ONCE(dom_net(&init_net)->mode) : dom_init_mode;
+	mutex_unlock(&dom_toggle_lock);
+	return sprintf(buffer, "%s\n", mode == DOM_FILTER_MODE_BLOCK ? "block" : "no_block");
+}
+
+// A new namespace gets nothing but its zeroed dom_net, see dom_net_activate
+static int __net_init dom_net_init(struct net *net) {
+	struct dom_net *dn = dom_net(net);
+
+	dn->net = net;
+	mutex_init(&dn->lock);
+	return 0;
+}
+
+static void __net_exit dom_net_exit(struct net *net) {
+	struct dom_net *dn = dom_net(net);
+
+	mutex_lock(&dom_mode_lock);
+	if (dn->mode == DOM_FILTER_MODE_BLOCK)
+		static_branch_dec(&dom_block_any);
+	mutex_unlock(&dom_mode_lock);
+
+	if (!dn->active)
+		return;
+	remove_proc_entry("domnetfilter", net->proc_net);
+	// Waits for the hooks still running in this namespace
+	dom_unregister_hooks(net);
+	// Cached flows of this namespace point at its rules, the next struct net at the same address
+	// must not find them
+	dom_flow_flush_net(net);
+	dom_ruleset_free(rcu_dereference_protected(dn->ruleset, 1));
+	dom_stats_free(&dn->in_stats);
+	dom_stats_free(&dn->out_stats);
+}
+
+static struct pernet_operations dom_net_ops = {
+	.init = dom_net_init,
+	.exit = dom_net_exit,
+	.id = &dom_net_id,
+	.size = sizeof(struct dom_net),
+};
+
+static int dom_ioctl_load(struct dom_net *dn, struct dom_filter_load __user *uarg) {
+	struct dom_filter_rule *rules = NULL;
+	struct dom_filter_prefix *prefixes = NULL;
+	struct dom_filter_load ld;
+	unsigned int max = READ_ONCE(max_load);
+	int err = 0;
+
+	if (copy_from_user(&ld, uarg, sizeof(ld)))
+		return -EFAULT;
+	if ((ld.flags & ~DOM_FILTER_LOAD_IF_VERSION) || ld.pad)
+		return -EINVAL;
+	if (ld.nr_rules > max || ld.nr_prefixes > max)
+		return -E2BIG;
+
+	if (ld.nr_rules) {
+		rules = vmemdup_user(u64_to_user_ptr(ld.rules), array_size(ld.nr_rules, sizeof(*rules)));
+		if (IS_ERR(rules))
+			return PTR_ERR(rules);
+	}
+	if (ld.nr_prefixes) {
+		prefixes = vmemdup_user(u64_to_user_ptr(ld.prefixes), array_size(ld.nr_prefixes, sizeof(*prefixes)));
+		if (IS_ERR(prefixes)) {
+			err = PTR_ERR(prefixes);
+			prefixes = NULL;
+			goto out;
 		}
 	}
 
-	// what to do with the packets...
- 	if (!strcmp(toggle_string, "block"))	
- 		return NF_DROP;
- 	else		
-		return NF_ACCEPT;
+	err = dom_ruleset_load(dn, rules, ld.nr_rules, prefixes, ld.nr_prefixes, &ld.version,
+			       ld.flags & DOM_FILTER_LOAD_IF_VERSION);
+	if (err == 0 && put_user(ld.version, &uarg->version))
+		err = -EFAULT;
+out:
+	kvfree(prefixes);
+	kvfree(rules);
+	return err;
 }
 
+// The device acts on the network namespace of whoever opened it, like a socket would
 static int dom_netfilter_open(struct inode *inode, struct file *file) {
-    return 0;
+	file->private_data = get_net(current->nsproxy->net_ns);
+	return 0;
 }
 
 static int dom_netfilter_release(struct inode *inode, struct file *file) {
-    return 0;
+	put_net(file->private_data);
+	return 0;
 }
 
 static long dom_netfilter_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+	struct dom_net *dn = dom_net(file->private_data);
+	struct dom_filter_rule r;
+	struct dom_filter_prefix p;
+	struct dom_filter_stats st;
+	struct dom_filter_rule_stats rst;
+	struct dom_filter_flow_stats fs;
+	unsigned int addr;
+	__u32 mode;
+	__u64 version;
+	int err;
+
 	switch (cmd) {
 	case IOCTL_FILTER_ADDRESS:
-		if (copy_from_user(&ioctl_set_addr, (void *) arg, sizeof(ioctl_set_addr)))
+	case IOCTL_FILTER_ADD_RULE:
+	case IOCTL_FILTER_DEL_RULE:
+	case IOCTL_FILTER_ADD_PREFIX:
+	case IOCTL_FILTER_DEL_PREFIX:
+	case IOCTL_FILTER_SET_MODE:
+	case IOCTL_FILTER_LOAD:
+	case IOCTL_FILTER_FLUSH:
+		// Before anything is copied, an IOCTL_FILTER_LOAD can be big
+		if (!dom_net_capable(dn))
+			return -EPERM;
+		break;
+	}
+
+	switch (cmd) {
+	case IOCTL_FILTER_ADDRESS:
+		if (copy_from_user(&addr, (void *) arg, sizeof(addr)))
 			return -EFAULT;
-		atomic_set(&ioctl_set, 1);
+		WRITE_ONCE(dn->ioctl_set_addr, addr);
+		atomic_set(&dn->ioctl_set, 1);
 		break;
 
+	case IOCTL_FILTER_ADD_RULE:
+	case IOCTL_FILTER_DEL_RULE:
+		if (copy_from_user(&r, (void *) arg, sizeof(r)))
+			return -EFAULT;
+		if (r.pad)
+			return -EINVAL;
+		return cmd == IOCTL_FILTER_ADD_RULE ? dom_rule_add(dn, &r) : dom_rule_del(dn, &r);
+
+	case IOCTL_FILTER_ADD_PREFIX:
+	case IOCTL_FILTER_DEL_PREFIX:
+		if (copy_from_user(&p, (void *) arg, sizeof(p)))
+			return -EFAULT;
+		if (cmd == IOCTL_FILTER_DEL_PREFIX)
+			p.action = DOM_FILTER_ALLOW;
+		err = dom_prefix_normalize(&p);
+		if (err)
+			return err;
+		return dom_prefix_change(dn, &p, cmd == IOCTL_FILTER_ADD_PREFIX);
+
+	case IOCTL_FILTER_SET_MODE:
+		if (copy_from_user(&mode, (void *) arg, sizeof(mode)))
+			return -EFAULT;
+		if (mode != DOM_FILTER_MODE_ALLOW && mode != DOM_FILTER_MODE_BLOCK)
+			return -EINVAL;
+		return dom_net_set_mode(dn, mode);
+
+	case IOCTL_FILTER_GET_MODE:
+		mode = READ_ONCE(dn->mode);
+		if (copy_to_user((void *) arg, &mode, sizeof(mode)))
+			return -EFAULT;
+		break;
+
+	case IOCTL_FILTER_GET_STATS:
+		if (copy_from_user(&st, (void *) arg, sizeof(st)))
+			return -EFAULT;
+		if ((st.flags & ~(DOM_FILTER_STATS_RESET | DOM_FILTER_STATS_INGRESS)) || st.pad)
+			return -EINVAL;
+		if ((st.flags & DOM_FILTER_STATS_RESET) && !dom_net_capable(dn))
+			return -EPERM;
+		// A namespace without hooks hasn't counted anything
+		memset(&st.counters, 0, sizeof(st.counters));
+		mutex_lock(&dn->lock);
+		if (dn->active)
+			dom_stats_read(st.flags & DOM_FILTER_STATS_INGRESS ? &dn->in_stats : &dn->out_stats,
+				       &st.counters, st.flags & DOM_FILTER_STATS_RESET);
+		mutex_unlock(&dn->lock);
+		if (copy_to_user((void *) arg, &st, sizeof(st)))
+			return -EFAULT;
+		break;
+
+	case IOCTL_FILTER_GET_RULE_STATS:
+		if (copy_from_user(&rst, (void *) arg, sizeof(rst)))
+			return -EFAULT;
+		if ((rst.flags & ~DOM_FILTER_STATS_RESET) || rst.pad)
+			return -EINVAL;
+		if ((rst.flags & DOM_FILTER_STATS_RESET) && !dom_net_capable(dn))
+			return -EPERM;
+		err = dom_rule_stats(dn, &rst.rule, &rst.counters, rst.flags & DOM_FILTER_STATS_RESET);
+		if (err)
+			return err;
+		if (copy_to_user((void *) arg, &rst, sizeof(rst)))
+			return -EFAULT;
+		break;
+
+	case IOCTL_FILTER_GET_FLOW_STATS:
+		// They count the traffic of every namespace, see dom_stats_show
+		if (!net_eq(dn->net, &init_net))
+			return -EPERM;
+		dom_flow_stats(&fs);
+		if (copy_to_user((void *) arg, &fs, sizeof(fs)))
+			return -EFAULT;
+		break;
+
+	case IOCTL_FILTER_LOAD:
+		return dom_ioctl_load(dn, (struct dom_filter_load __user *) arg);
+
+	case IOCTL_FILTER_GET_VERSION:
+		version = 0;
+		mutex_lock(&dn->lock);
+		if (dn->active)
+			version = dom_ruleset_locked(dn)->version;
+		mutex_unlock(&dn->lock);
+		if (copy_to_user((void *) arg, &version, sizeof(version)))
+			return -EFAULT;
+		break;
+
+	case IOCTL_FILTER_FLUSH:
+		// Nothing to flush in a namespace that never had rules
+		if (!READ_ONCE(dn->active))
+			break;
+		// Same as loading an empty list
+		return dom_ruleset_load(dn, NULL, 0, NULL, 0, &version, false);
+
 	default:
 		return -ENOTTY; //indicates ioctl is not setup properly
 	}
@@ -120,14 +1172,36 @@ int __init domnet_init(void) {
 	printk("domnetfilter: Doms Network Filter Started!");
 	printk("domnetfilter: Major number %d", dev_major);
 	
-	atomic_set(&ioctl_set, 0);
-	ioctl_set_addr = 0;
+	// Say how many SYNs were dropped from the trace only when the module goes away, not in the kernel log every second
+	ratelimit_set_flags(&dom_syn_ratelimit, RATELIMIT_MSG_ON_RELEASE);
+
+	err = dom_flow_init();
+	if (err) {
+		unregister_chrdev_region(MKDEV(dev_major, 0), 1);
+		return err;
+	}
+	err = register_pernet_subsys(&dom_net_ops);
+	if (err) {
+		dom_flow_exit();
+		unregister_chrdev_region(MKDEV(dev_major, 0), 1);
+		rcu_barrier();
+		return err;
+	}
+
+	// The initial namespace is filtered from the start, like it always was. The others wait for
+	// their first rule.
+	mutex_lock(&dom_toggle_lock);
+	err = dom_net_activate(dom_net(&init_net));
+	if (err == 0)
+		err = dom_net_set_mode(dom_net(&init_net), dom_init_mode);
+	if (err == 0)
+		dom_ready = true;
+	mutex_unlock(&dom_toggle_lock);
+	if (err)
+		goto out;
 
 	cdev_init(&dom_cdev, &fops);
-	cdev_add(&dom_cdev, MKDEV(dev_major, 0), 1);
-	
-	err = nf_register_net_hook(&init_net, &net_nfho);
-	
+	err = cdev_add(&dom_cdev, MKDEV(dev_major, 0), 1);
 	if (err)
 		goto out;
 
@@ -136,16 +1210,29 @@ int __init domnet_init(void) {
 out:
 	// cleanup the device if init not successful
 	printk("domnetfilter: Doms Network Filter Destroyed!");
-	cdev_del(&dom_cdev);
+	unregister_pernet_subsys(&dom_net_ops);
 	unregister_chrdev_region(MKDEV(dev_major, 0), 1);
+	dom_flow_exit();
+	rcu_barrier();
 	return err;
 }
 
 void __exit domnet_exit(void) {
 	printk("domnetfilter: Doms Network Filter Destroyed!");
-	nf_unregister_net_hook(&init_net, &net_nfho);
 	cdev_del(&dom_cdev);
 	unregister_chrdev_region(MKDEV(dev_major, 0), 1);
+	mutex_lock(&dom_toggle_lock);
+	dom_ready = false;
+	mutex_unlock(&dom_toggle_lock);
+
+	// Runs dom_net_exit for every namespace: their hooks, rules and counters go away
+	unregister_pernet_subsys(&dom_net_ops);
+	// No hook traces SYNs any more, say how many the ratelimit kept out of the trace
+	ratelimit_state_exit(&dom_syn_ratelimit);
+
+	// No packet or ioctl can reach the rules any more, wait for those still queued for call_rcu
+	dom_flow_exit();
+	rcu_barrier();
 }
 
 module_init(domnet_init);
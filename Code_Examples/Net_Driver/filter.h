@@ -0,0 +1,107 @@
+// ioctl interface of the domnetfilter char device, shared with user space
+// Every ioctl acts on the network namespace of the process that opened the device.
+
+#ifndef _DOM_FILTER_H
+#define _DOM_FILTER_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+// What a rule does with the packets it matches
+#define DOM_FILTER_ALLOW	0
+#define DOM_FILTER_BLOCK	1
+
+// What happens to packets that no rule or prefix matches, see IOCTL_FILTER_SET_MODE
+enum dom_filter_mode {
+	DOM_FILTER_MODE_ALLOW = DOM_FILTER_ALLOW,
+	DOM_FILTER_MODE_BLOCK = DOM_FILTER_BLOCK,
+};
+
+// A rule for one destination address, or one address and port. Addresses and ports are in
+// network byte order, a dport of 0 matches every port (and every protocol). With ingress=1 a
+// rule also matches incoming packets from that address (and source port).
+struct dom_filter_rule {
+	__be32 daddr;
+	__be16 dport;
+	__u8 action;		// DOM_FILTER_ALLOW or DOM_FILTER_BLOCK
+	__u8 pad;		// must be 0
+};
+
+// A CIDR rule, e.g. 10.0.0.0/8 or 2001:db8::/32. The longest prefix that covers the destination
+// wins. addr is in network byte order, IPv4 uses its first 4 bytes.
+struct dom_filter_prefix {
+	__u8 family;		// AF_INET or AF_INET6
+	__u8 len;		// prefix length in bits
+	__u8 action;		// DOM_FILTER_ALLOW or DOM_FILTER_BLOCK
+	__u8 pad;		// must be 0
+	__u8 addr[16];
+};
+
+// Packet counters, kept for all outgoing packets, all incoming packets (with ingress=1) and
+// for every exact rule
+struct dom_filter_counters {
+	__u64 packets;
+	__u64 bytes;
+	__u64 syns;		// TCP SYNs without ACK, i.e. new outgoing connections
+	__u64 drops;
+	__u64 accepts;
+};
+
+#define DOM_FILTER_STATS_RESET	1	// counting starts over from this read
+#define DOM_FILTER_STATS_INGRESS 2	// the incoming packets instead of the outgoing ones
+
+struct dom_filter_stats {
+	__u32 flags;		// DOM_FILTER_STATS_*
+	__u32 pad;		// must be 0
+	struct dom_filter_counters counters;
+};
+
+struct dom_filter_rule_stats {
+	struct dom_filter_rule rule;	// which rule, action is ignored
+	__u32 flags;		// DOM_FILTER_STATS_RESET or 0
+	__u32 pad;		// must be 0
+	struct dom_filter_counters counters;
+};
+
+// How the flow cache is doing. The hit ratio is hits / (hits + misses + stale). The cache is shared
+// by all network namespaces, so only the initial one may read this.
+struct dom_filter_flow_stats {
+	__u64 hits;		// packets that took the verdict cached at their connection's SYN
+	__u64 misses;		// TCP packets past the SYN of connections not in the cache
+	__u64 stale;		// cached, but the rules or the mode changed since
+	__u64 inserts;
+	__u64 evictions;	// pushed out of a full cache
+	__u64 expired;		// idle for flow_timeout seconds, or stale
+	__u64 entries;		// cached right now
+	__u64 capacity;
+};
+
+// A complete list for IOCTL_FILTER_LOAD, it replaces every rule and prefix in one go. Packets
+// see either the old list or the new one, never a mix.
+#define DOM_FILTER_LOAD_IF_VERSION	1	// fail with ESTALE unless the live version is still version
+
+struct dom_filter_load {
+	__u64 rules;		// user pointer to nr_rules struct dom_filter_rule
+	__u64 prefixes;		// user pointer to nr_prefixes struct dom_filter_prefix
+	__u32 nr_rules;
+	__u32 nr_prefixes;
+	__u32 flags;		// DOM_FILTER_LOAD_IF_VERSION or 0
+	__u32 pad;		// must be 0
+	__u64 version;		// in: see DOM_FILTER_LOAD_IF_VERSION, out: the version of the new list
+};
+
+#define IOCTL_FILTER_ADDRESS	_IOW('k', 1, unsigned int) // Used for creating the ioctl command number
+#define IOCTL_FILTER_ADD_RULE	_IOW('k', 2, struct dom_filter_rule) // Adds a rule, or changes the action of an existing one
+#define IOCTL_FILTER_DEL_RULE	_IOW('k', 3, struct dom_filter_rule) // action is ignored
+#define IOCTL_FILTER_FLUSH	_IO('k', 4) // Removes every rule and prefix
+#define IOCTL_FILTER_ADD_PREFIX	_IOW('k', 5, struct dom_filter_prefix) // Adds a prefix, or changes the action of an existing one
+#define IOCTL_FILTER_DEL_PREFIX	_IOW('k', 6, struct dom_filter_prefix) // action is ignored
+#define IOCTL_FILTER_SET_MODE	_IOW('k', 7, __u32) // Takes an enum dom_filter_mode, same as toggle_string
+#define IOCTL_FILTER_GET_MODE	_IOR('k', 8, __u32)
+#define IOCTL_FILTER_GET_STATS	_IOWR('k', 9, struct dom_filter_stats) // The counters of all packets
+#define IOCTL_FILTER_GET_RULE_STATS _IOWR('k', 10, struct dom_filter_rule_stats) // The counters of one rule
+#define IOCTL_FILTER_LOAD	_IOWR('k', 11, struct dom_filter_load)
+#define IOCTL_FILTER_GET_VERSION _IOR('k', 12, __u64) // Bumped by every change to rules or prefixes
+#define IOCTL_FILTER_GET_FLOW_STATS _IOR('k', 13, struct dom_filter_flow_stats) // EPERM outside the initial namespace
+
+#endif /* _DOM_FILTER_H */
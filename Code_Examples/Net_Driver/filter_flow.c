@@ -0,0 +1,324 @@
+// Flow cache for the domnetfilter hook
+// The policy is decided once per TCP connection, at its SYN. So the hook remembers the verdict
+// (and the rule that gave it) for every connection it has decided, and the rest of the
+// connection's packets take one hash lookup instead of going through the rules again. A
+// connection the cache doesn't know goes through the rules once and is remembered from then on.
+//
+// The hash table is split into shards, each with its own lock and its own LRU list, so inserts
+// on different CPUs rarely meet. Lookups take no lock at all, they walk the buckets under RCU.
+// A full shard makes room by evicting from the tail of its list, giving flows that saw a packet
+// in the last second a second chance (the CLOCK approximation of LRU: a hit only writes a
+// timestamp, it never takes a lock to reorder a list). A work item expires idle flows.
+//
+// Cached verdicts carry the generation they were made in. Any change to the rules or the mode of a
+// namespace bumps its generation, which turns every cached verdict of that namespace stale at once.
+// The generation lives in the namespace's dom_net, the hook passes it in.
+//
+// There is one cache for all network namespaces, a flow's key includes its namespace. Sizing it
+// per namespace would make every new namespace pay for a table it most likely never fills.
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/rculist.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/log2.h>
+#include <net/net_namespace.h>
+
+#include "filter.h"
+#include "filter_flow.h"
+
+static unsigned int flow_cache_size = 65536;
+module_param(flow_cache_size, uint, 0444);
+MODULE_PARM_DESC(flow_cache_size, "How many TCP connections the flow cache remembers, 0 turns it off");
+
+static unsigned int flow_timeout = 60;
+module_param(flow_timeout, uint, 0644);
+MODULE_PARM_DESC(flow_timeout, "Seconds without a packet before a flow is dropped from the cache");
+
+#define DOM_FLOW_SHARDS		256
+#define DOM_FLOW_EVICT_TRIES	8	// How many recently used flows an insert skips before evicting anyway
+
+struct dom_flow {
+	struct hlist_node node;		// in its bucket, RCU
+	struct list_head lru;		// in its shard, under the shard lock
+	struct dom_flow_key key;
+	unsigned int verdict;
+	unsigned long gen;
+	struct dom_rule *rule;		// safe to use while gen is current, see dom_flow_invalidate
+	unsigned long last_used;	// jiffies of the last hit
+	struct rcu_head rcu;
+};
+
+struct dom_flow_counters {
+	u64 hits;
+	u64 misses;
+	u64 stale;
+	u64 inserts;
+	u64 evictions;
+	u64 expired;
+};
+
+struct dom_flow_shard {
+	spinlock_t lock;
+	struct list_head lru;		// newest (or spared) first
+	unsigned int nr;
+} ____cacheline_aligned_in_smp;
+
+struct dom_flow_cache {
+	struct hlist_head *buckets;
+	unsigned int mask;
+	unsigned int shard_max;		// entries per shard
+	u32 seed;
+	struct dom_flow_counters __percpu *stats;
+	struct delayed_work gc;
+	struct dom_flow_shard shards[DOM_FLOW_SHARDS];
+};
+
+static struct dom_flow_cache *dom_flows; // NULL with flow_cache_size=0
+
+static inline u32 dom_flow_hash(const struct dom_flow_cache *fc, const struct dom_flow_key *key) {
+	return jhash_3words((__force u32)key->saddr, (__force u32)key->daddr,
+			    (__force u32)key->sport << 16 | (__force u32)key->dport, fc->seed ^ net_hash_mix(key->net));
+}
+
+static inline bool dom_flow_key_equal(const struct dom_flow_key *a, const struct dom_flow_key *b) {
+	return a->net == b->net && a->saddr == b->saddr && a->daddr == b->daddr &&
+	       a->sport == b->sport && a->dport == b->dport;
+}
+
+// A bucket belongs to the shard of the low bits of its hash, the mask is never smaller than the shards
+static inline struct dom_flow_shard *dom_flow_shard(struct dom_flow_cache *fc, u32 hash) {
+	return &fc->shards[hash & (DOM_FLOW_SHARDS - 1)];
+}
+
+static void dom_flow_unlink(struct dom_flow_shard *shard, struct dom_flow *f) {
+	hlist_del_rcu(&f->node);
+	list_del(&f->lru);
+	shard->nr--;
+	kfree_rcu(f, rcu);
+}
+
+enum dom_flow_result dom_flow_lookup(const struct dom_flow_key *key, unsigned long gen,
+				     struct dom_rule **rule, unsigned int *verdict) {
+	struct dom_flow_cache *fc = dom_flows;
+	struct dom_flow *f;
+
+	if (fc == NULL)
+		return DOM_FLOW_MISS;
+
+	hlist_for_each_entry_rcu(f, &fc->buckets[dom_flow_hash(fc, key) & fc->mask], node) {
+		if (!dom_flow_key_equal(&f->key, key))
+			continue;
+		if (f->gen != gen) {
+			this_cpu_inc(fc->stats->stale);
+			return DOM_FLOW_STALE;
+		}
+		// Only dirty the line once per tick, a busy flow shouldn't bounce it between CPUs
+		if (READ_ONCE(f->last_used) != jiffies)
+			WRITE_ONCE(f->last_used, jiffies);
+		*rule = f->rule;
+		*verdict = f->verdict;
+		this_cpu_inc(fc->stats->hits);
+		return DOM_FLOW_HIT;
+	}
+	this_cpu_inc(fc->stats->misses);
+	return DOM_FLOW_MISS;
+}
+
+static bool dom_flow_recent(const struct dom_flow *f) {
+	return time_before(jiffies, READ_ONCE(f->last_used) + HZ);
+}
+
+// Make room for one more flow in a full shard, under its lock
+static void dom_flow_evict(struct dom_flow_cache *fc, struct dom_flow_shard *shard) {
+	struct dom_flow *f = list_last_entry(&shard->lru, struct dom_flow, lru);
+	unsigned int tries;
+
+	for (tries = 0; tries < DOM_FLOW_EVICT_TRIES && dom_flow_recent(f); tries++) {
+		list_move(&f->lru, &shard->lru);
+		f = list_last_entry(&shard->lru, struct dom_flow, lru);
+	}
+	dom_flow_unlink(shard, f);
+	this_cpu_inc(fc->stats->evictions);
+}
+
+// Remember the verdict for a flow, replacing whatever was cached for it. gen is the generation
+// read before the verdict was worked out, so a change made meanwhile leaves the entry stale.
+void dom_flow_insert(const struct dom_flow_key *key, unsigned long gen,
+		     struct dom_rule *rule, unsigned int verdict) {
+	struct dom_flow_cache *fc = dom_flows;
+	struct dom_flow_shard *shard;
+	struct hlist_head *bucket;
+	struct dom_flow *f, *old;
+	u32 hash;
+
+	if (fc == NULL)
+		return;
+
+	f = kmalloc(sizeof(*f), GFP_ATOMIC);
+	if (f == NULL)
+		return;
+	f->key = *key;
+	f->verdict = verdict;
+	f->gen = gen;
+	f->rule = rule;
+	f->last_used = jiffies;
+
+	hash = dom_flow_hash(fc, key);
+	shard = dom_flow_shard(fc, hash);
+	bucket = &fc->buckets[hash & fc->mask];
+
+	// The hook runs in process context and in softirqs
+	spin_lock_bh(&shard->lock);
+	hlist_for_each_entry(old, bucket, node) {
+		if (dom_flow_key_equal(&old->key, key)) {
+			dom_flow_unlink(shard, old);
+			break;
+		}
+	}
+	if (shard->nr >= fc->shard_max)
+		dom_flow_evict(fc, shard);
+	hlist_add_head_rcu(&f->node, bucket);
+	list_add(&f->lru, &shard->lru);
+	shard->nr++;
+	spin_unlock_bh(&shard->lock);
+
+	this_cpu_inc(fc->stats->inserts);
+}
+
+// Drop flows that have been idle for flow_timeout. A stale flow that is still busy stays, its
+// next packet refreshes it in place (and a full shard evicts stale flows first anyway).
+static void dom_flow_gc(struct work_struct *work) {
+	struct dom_flow_cache *fc = container_of(to_delayed_work(work), struct dom_flow_cache, gc);
+	unsigned long timeout = (unsigned long)READ_ONCE(flow_timeout) * HZ;
+	struct dom_flow *f, *next;
+	unsigned int i;
+	u64 expired = 0;
+
+	for (i = 0; i < DOM_FLOW_SHARDS; i++) {
+		struct dom_flow_shard *shard = &fc->shards[i];
+
+		spin_lock_bh(&shard->lock);
+		list_for_each_entry_safe(f, next, &shard->lru, lru) {
+			if (time_before(jiffies, READ_ONCE(f->last_used) + timeout))
+				continue;
+			dom_flow_unlink(shard, f);
+			expired++;
+		}
+		spin_unlock_bh(&shard->lock);
+		cond_resched();
+	}
+	this_cpu_add(fc->stats->expired, expired);
+
+	queue_delayed_work(system_power_efficient_wq, &fc->gc, HZ);
+}
+
+void dom_flow_flush_net(const struct net *net) {
+	struct dom_flow_cache *fc = dom_flows;
+	struct dom_flow *f, *next;
+	unsigned int i;
+
+	if (fc == NULL)
+		return;
+
+	for (i = 0; i < DOM_FLOW_SHARDS; i++) {
+		struct dom_flow_shard *shard = &fc->shards[i];
+
+		spin_lock_bh(&shard->lock);
+		list_for_each_entry_safe(f, next, &shard->lru, lru) {
+			if (f->key.net == net)
+				dom_flow_unlink(shard, f);
+		}
+		spin_unlock_bh(&shard->lock);
+		cond_resched();
+	}
+}
+
+void dom_flow_stats(struct dom_filter_flow_stats *out) {
+	struct dom_flow_cache *fc = dom_flows;
+	unsigned int i;
+	int cpu;
+
+	memset(out, 0, sizeof(*out));
+	if (fc == NULL)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct dom_flow_counters *c = per_cpu_ptr(fc->stats, cpu);
+
+		out->hits += READ_ONCE(c->hits);
+		out->misses += READ_ONCE(c->misses);
+		out->stale += READ_ONCE(c->stale);
+		out->inserts += READ_ONCE(c->inserts);
+		out->evictions += READ_ONCE(c->evictions);
+		out->expired += READ_ONCE(c->expired);
+	}
+	for (i = 0; i < DOM_FLOW_SHARDS; i++)
+		out->entries += READ_ONCE(fc->shards[i].nr);
+	out->capacity = (u64)fc->shard_max * DOM_FLOW_SHARDS;
+}
+
+int dom_flow_init(void) {
+	struct dom_flow_cache *fc;
+	unsigned int i, size;
+
+	if (flow_cache_size == 0)
+		return 0;
+	size = roundup_pow_of_two(clamp(flow_cache_size, (unsigned int)DOM_FLOW_SHARDS, 1U << 24));
+
+	fc = kzalloc(sizeof(*fc), GFP_KERNEL);
+	if (fc == NULL)
+		return -ENOMEM;
+	fc->buckets = kvcalloc(size, sizeof(*fc->buckets), GFP_KERNEL);
+	fc->stats = alloc_percpu(struct dom_flow_counters);
+	if (fc->buckets == NULL || fc->stats == NULL) {
+		free_percpu(fc->stats);
+		kvfree(fc->buckets);
+		kfree(fc);
+		return -ENOMEM;
+	}
+	fc->mask = size - 1;
+	fc->shard_max = size / DOM_FLOW_SHARDS;
+	fc->seed = get_random_u32();
+	for (i = 0; i < DOM_FLOW_SHARDS; i++) {
+		spin_lock_init(&fc->shards[i].lock);
+		INIT_LIST_HEAD(&fc->shards[i].lru);
+	}
+	INIT_DELAYED_WORK(&fc->gc, dom_flow_gc);
+	queue_delayed_work(system_power_efficient_wq, &fc->gc, HZ);
+
+	dom_flows = fc;
+	return 0;
+}
+
+// After the hooks are gone. The caller waits for the flows still queued for kfree_rcu.
+void dom_flow_exit(void) {
+	struct dom_flow_cache *fc = dom_flows;
+	struct dom_flow *f, *next;
+	unsigned int i;
+
+	if (fc == NULL)
+		return;
+	dom_flows = NULL;
+
+	cancel_delayed_work_sync(&fc->gc);
+	for (i = 0; i < DOM_FLOW_SHARDS; i++) {
+		struct dom_flow_shard *shard = &fc->shards[i];
+
+		spin_lock_bh(&shard->lock);
+		list_for_each_entry_safe(f, next, &shard->lru, lru)
+			dom_flow_unlink(shard, f);
+		spin_unlock_bh(&shard->lock);
+	}
+	free_percpu(fc->stats);
+	kvfree(fc->buckets);
+	kfree(fc);
+}
@@ -0,0 +1,60 @@
+// Flow cache for the domnetfilter hook, see filter_flow.c
+
+#ifndef _DOM_FILTER_FLOW_H
+#define _DOM_FILTER_FLOW_H
+
+#include <linux/types.h>
+#include <linux/atomic.h>
+
+#include "filter.h"
+
+struct dom_rule;
+struct net;
+
+// A TCP connection as the hook sees it on the way out. The same addresses can be in use in
+// different namespaces, and only the namespace's own rules apply to each.
+struct dom_flow_key {
+	const struct net *net;
+	__be32 saddr;
+	__be32 daddr;
+	__be16 sport;
+	__be16 dport;
+};
+
+enum dom_flow_result {
+	DOM_FLOW_MISS,		// not cached
+	DOM_FLOW_STALE,		// cached, but the rules changed since
+	DOM_FLOW_HIT,
+};
+
+// Every namespace has its own generation, bumped by every change to its rules or its mode. A
+// cached verdict is only good for the generation of its namespace it was made in, so a change in
+// one namespace leaves the flows of all the others alone.
+static inline unsigned long dom_flow_gen(atomic_long_t *generation) {
+	unsigned long gen = atomic_long_read(generation);
+
+	smp_rmb(); // pairs with dom_flow_invalidate, the rules are read after the generation
+	return gen;
+}
+
+// Call after the change is visible to the hook, and before anything it replaced is freed
+static inline void dom_flow_invalidate(atomic_long_t *generation) {
+	atomic_long_inc_return(generation); // the _return variant is fully ordered
+}
+
+int dom_flow_init(void);
+void dom_flow_exit(void);
+
+// After the namespace's hooks are gone. The next struct net at the same address starts over at
+// generation 0, so its old flows can't just be left to go stale.
+void dom_flow_flush_net(const struct net *net);
+
+// Both under rcu_read_lock, from the hook
+enum dom_flow_result dom_flow_lookup(const struct dom_flow_key *key, unsigned long gen,
+				     struct dom_rule **rule, unsigned int *verdict);
+void dom_flow_insert(const struct dom_flow_key *key, unsigned long gen,
+		     struct dom_rule *rule, unsigned int verdict);
+
+void dom_flow_stats(struct dom_filter_flow_stats *out);
+
+#endif /* _DOM_FILTER_FLOW_H */
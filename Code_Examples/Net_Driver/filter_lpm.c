@@ -0,0 +1,445 @@
+// Longest prefix match for the domnetfilter CIDR rules
+// The prefixes are compiled into a poptrie (Asai and Ohara, SIGCOMM 2015), one for IPv4 and
+// one for IPv6. Every node of the trie consumes 6 bits of the address and has 64 slots. A slot
+// either leads to a child node or ends in a leaf, the value of the longest prefix that covers it.
+// Instead of 64 pointers a node keeps two bitmaps: vector marks the slots with a child and
+// leafvec marks where a run of equal leaves starts. The children and the leaves of a node are
+// stored next to each other, so the rank of a slot in its bitmap (one popcount) is its index.
+// An IPv4 lookup touches at most 6 nodes of 24 bytes each, and big runs of equal leaves
+// (all the space no prefix covers, for one) shrink to a single entry.
+//
+// A trie is never changed once it is built. Changing the rules means building a new prefix set
+// and swapping it in with RCU, so a lookup always sees one complete set.
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/sort.h>
+#include <linux/string.h>
+#include <linux/bitops.h>
+#include <linux/random.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/socket.h>
+#include <linux/in6.h>
+#include <asm/unaligned.h>
+
+#include "filter.h"
+#include "filter_lpm.h"
+
+#define DOM_LPM_STRIDE		6
+#define DOM_LPM_MAX_DEPTH	(128 / DOM_LPM_STRIDE + 1)
+
+struct dom_lpm_node {
+	u64 vector;	// bit s set: slot s leads to a child node
+	u64 leafvec;	// bit s set: slot s is a leaf that differs from the leaf before it
+	u32 base0;	// index of the first leaf of this node
+	u32 base1;	// index of the first child of this node
+};
+
+struct dom_lpm {
+	struct dom_lpm_node *nodes;	// nodes[0] is the root
+	u32 *leaves;			// 0 for no match, else 1 + the index of the prefix in its set
+	u32 nr_nodes, nr_leaves;
+	u32 max_nodes, max_leaves;	// room allocated, only used while building
+};
+
+struct dom_prefix_set {
+	struct dom_lpm v4, v6;
+	unsigned int nr;
+	struct dom_filter_prefix prefixes[];	// sorted by family, address and length
+};
+
+// A prefix as the builder sees it, the address as two host order words
+struct dom_lpm_entry {
+	u64 key[2];
+	unsigned int len;
+	u32 value;
+};
+
+// The 6 bits of key starting at bit off, counting from the most significant bit. Bits past
+// the end of the address read as 0.
+static inline unsigned int dom_lpm_bits(const u64 *key, unsigned int off) {
+	unsigned int w = off >> 6, b = off & 63;
+	u64 v;
+
+	if (w > 1)
+		return 0;
+	v = key[w] << b;
+	if (b > 64 - DOM_LPM_STRIDE && w == 0)
+		v |= key[1] >> (64 - b);
+	return v >> (64 - DOM_LPM_STRIDE);
+}
+
+static u32 dom_lpm_lookup(const struct dom_lpm *t, const u64 *key) {
+	const struct dom_lpm_node *n = &t->nodes[0];
+	unsigned int off = 0;
+
+	for (;;) {
+		unsigned int s = dom_lpm_bits(key, off);
+		u64 upto = (2ULL << s) - 1; // slots 0..s, all of them for s = 63
+
+		if (n->vector & (1ULL << s)) {
+			n = &t->nodes[n->base1 + hweight64(n->vector & upto) - 1];
+			off += DOM_LPM_STRIDE;
+			continue;
+		}
+		return t->leaves[n->base0 + hweight64(n->leafvec & upto) - 1];
+	}
+}
+
+static void dom_prefix_key(const struct dom_filter_prefix *p, u64 *key) {
+	if (p->family == AF_INET) {
+		key[0] = (u64)get_unaligned_be32(p->addr) << 32;
+		key[1] = 0;
+	}
+	else {
+		key[0] = get_unaligned_be64(p->addr);
+		key[1] = get_unaligned_be64(p->addr + 8);
+	}
+}
+
+// Grow an array built with kvmalloc to hold at least want elements
+static int dom_lpm_grow(void **array, u32 *max, u32 want, size_t size) {
+	u32 new_max = max_t(u32, *max * 2, 64);
+	void *bigger;
+
+	if (want <= *max)
+		return 0;
+	while (new_max < want)
+		new_max *= 2;
+	bigger = kvmalloc_array(new_max, size, GFP_KERNEL);
+	if (bigger == NULL)
+		return -ENOMEM;
+	if (*array)
+		memcpy(bigger, *array, (size_t)*max * size);
+	kvfree(*array);
+	*array = bigger;
+	*max = new_max;
+	return 0;
+}
+
+// Fill in node ni for the entries e[0..nr), which all lie inside the node's part of the address
+// space. depth is the number of address bits above the node, inherited the leaf of the longest
+// prefix that ends above it. slots is scratch space, 64 entries per level.
+static int dom_lpm_build_node(struct dom_lpm *t, u32 ni, const struct dom_lpm_entry *e, unsigned int nr,
+			      unsigned int depth, u32 inherited, u32 *slots) {
+	unsigned int i, s, start, child;
+	u64 vector = 0, leafvec = 0;
+	u32 base0, base1, prev = 0;
+	bool have_prev = false;
+	int err;
+
+	for (s = 0; s < 64; s++)
+		slots[s] = inherited;
+
+	// Sorted by address and then length, a prefix always comes before the longer ones inside
+	// it. So painting the slots in order leaves the longest match in each of them.
+	for (i = 0; i < nr; i++) {
+		unsigned int first, count;
+
+		if (e[i].len <= depth) // ends in an ancestor, already part of inherited
+			continue;
+		if (e[i].len > depth + DOM_LPM_STRIDE) {
+			vector |= 1ULL << dom_lpm_bits(e[i].key, depth);
+			continue;
+		}
+		first = dom_lpm_bits(e[i].key, depth);
+		count = 1U << (depth + DOM_LPM_STRIDE - e[i].len);
+		for (s = first; s < first + count; s++)
+			slots[s] = e[i].value;
+	}
+
+	// Leaves, one per run of equal values among the slots without a child
+	base0 = t->nr_leaves;
+	for (s = 0; s < 64; s++) {
+		if (vector & (1ULL << s))
+			continue;
+		if (!have_prev || slots[s] != prev) {
+			err = dom_lpm_grow((void **)&t->leaves, &t->max_leaves, t->nr_leaves + 1, sizeof(u32));
+			if (err)
+				return err;
+			leafvec |= 1ULL << s;
+			t->leaves[t->nr_leaves++] = slots[s];
+			prev = slots[s];
+			have_prev = true;
+		}
+	}
+
+	// The children of a node sit next to each other, so reserve them all before filling any in
+	base1 = t->nr_nodes;
+	err = dom_lpm_grow((void **)&t->nodes, &t->max_nodes, t->nr_nodes + hweight64(vector), sizeof(struct dom_lpm_node));
+	if (err)
+		return err;
+	t->nr_nodes += hweight64(vector);
+
+	t->nodes[ni].vector = vector;
+	t->nodes[ni].leafvec = leafvec;
+	t->nodes[ni].base0 = base0;
+	t->nodes[ni].base1 = base1;
+
+	// The entries of one slot are next to each other as well, hand each run to its child
+	child = base1;
+	for (i = 0; i < nr; i = start) {
+		s = dom_lpm_bits(e[i].key, depth);
+		for (start = i + 1; start < nr && dom_lpm_bits(e[start].key, depth) == s; start++)
+			;
+		if (!(vector & (1ULL << s)))
+			continue;
+		err = dom_lpm_build_node(t, child++, e + i, start - i, depth + DOM_LPM_STRIDE, slots[s], slots + 64);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+static int dom_lpm_build(struct dom_lpm *t, const struct dom_lpm_entry *e, unsigned int nr) {
+	u32 *slots, root = 0;
+	unsigned int i;
+	int err;
+
+	// A /0 covers everything, it is where the root's slots start from
+	for (i = 0; i < nr; i++)
+		if (e[i].len == 0)
+			root = e[i].value;
+
+	memset(t, 0, sizeof(*t));
+	slots = kmalloc_array(DOM_LPM_MAX_DEPTH * 64, sizeof(u32), GFP_KERNEL);
+	err = slots ? dom_lpm_grow((void **)&t->nodes, &t->max_nodes, 1, sizeof(struct dom_lpm_node)) : -ENOMEM;
+	if (err == 0) {
+		t->nr_nodes = 1;
+		err = dom_lpm_build_node(t, 0, e, nr, 0, root, slots);
+	}
+	kfree(slots);
+	return err;
+}
+
+static void dom_lpm_free(struct dom_lpm *t) {
+	kvfree(t->nodes);
+	kvfree(t->leaves);
+}
+
+static int dom_prefix_cmp(const void *a, const void *b) {
+	const struct dom_filter_prefix *x = a, *y = b;
+	int c;
+
+	if (x->family != y->family)
+		return x->family < y->family ? -1 : 1;
+	c = memcmp(x->addr, y->addr, sizeof(x->addr));
+	if (c)
+		return c;
+	return x->len < y->len ? -1 : x->len > y->len;
+}
+
+// Check a prefix from user space and clear the address bits past its length
+int dom_prefix_normalize(struct dom_filter_prefix *p) {
+	unsigned int bits, i;
+
+	if (p->family == AF_INET)
+		bits = 32;
+	else if (p->family == AF_INET6)
+		bits = 128;
+	else
+		return -EAFNOSUPPORT;
+	if (p->len > bits || p->pad || (p->action != DOM_FILTER_ALLOW && p->action != DOM_FILTER_BLOCK))
+		return -EINVAL;
+
+	for (i = 0; i < sizeof(p->addr); i++) {
+		unsigned int keep = clamp_t(int, (int)p->len - (int)i * 8, 0, 8);
+		p->addr[i] &= (u8)(0xff00 >> keep);
+	}
+	return 0;
+}
+
+bool dom_prefix_equal(const struct dom_filter_prefix *a, const struct dom_filter_prefix *b) {
+	return a->family == b->family && a->len == b->len && !memcmp(a->addr, b->addr, sizeof(a->addr));
+}
+
+static int dom_prefix_set_build_family(struct dom_prefix_set *set, struct dom_lpm *t, u8 family) {
+	struct dom_lpm_entry *e;
+	unsigned int i, nr = 0;
+	int err;
+
+	e = kvmalloc_array(max(set->nr, 1U), sizeof(*e), GFP_KERNEL);
+	if (e == NULL)
+		return -ENOMEM;
+	for (i = 0; i < set->nr; i++) {
+		if (set->prefixes[i].family != family)
+			continue;
+		dom_prefix_key(&set->prefixes[i], e[nr].key);
+		e[nr].len = set->prefixes[i].len;
+		e[nr].value = i + 1;
+		nr++;
+	}
+	err = dom_lpm_build(t, e, nr);
+	kvfree(e);
+	return err;
+}
+
+// Build a prefix set from nr normalized prefixes. Of prefixes that are the same, one is kept.
+struct dom_prefix_set *dom_prefix_set_build(const struct dom_filter_prefix *prefixes, unsigned int nr) {
+	struct dom_prefix_set *set;
+	unsigned int i, kept = 0;
+	int err;
+
+	set = kvmalloc(struct_size(set, prefixes, nr), GFP_KERNEL);
+	if (set == NULL)
+		return ERR_PTR(-ENOMEM);
+	memset(set, 0, sizeof(*set));
+	memcpy(set->prefixes, prefixes, nr * sizeof(*prefixes));
+	sort(set->prefixes, nr, sizeof(*prefixes), dom_prefix_cmp, NULL);
+	for (i = 0; i < nr; i++) {
+		if (kept && dom_prefix_equal(&set->prefixes[kept - 1], &set->prefixes[i]))
+			continue;
+		set->prefixes[kept++] = set->prefixes[i];
+	}
+	set->nr = kept;
+
+	err = dom_prefix_set_build_family(set, &set->v4, AF_INET);
+	if (err == 0)
+		err = dom_prefix_set_build_family(set, &set->v6, AF_INET6);
+	if (err) {
+		dom_prefix_set_free(set);
+		return ERR_PTR(err);
+	}
+	return set;
+}
+
+void dom_prefix_set_free(struct dom_prefix_set *set) {
+	if (set == NULL)
+		return;
+	dom_lpm_free(&set->v4);
+	dom_lpm_free(&set->v6);
+	kvfree(set);
+}
+
+unsigned int dom_prefix_set_size(const struct dom_prefix_set *set) {
+	return set ? set->nr : 0;
+}
+
+const struct dom_filter_prefix *dom_prefix_set_prefixes(const struct dom_prefix_set *set) {
+	return set->prefixes;
+}
+
+const struct dom_filter_prefix *dom_prefix_lookup4(const struct dom_prefix_set *set, __be32 daddr) {
+	u64 key[2] = { (u64)be32_to_cpu(daddr) << 32, 0 };
+	u32 v = dom_lpm_lookup(&set->v4, key);
+
+	return v ? &set->prefixes[v - 1] : NULL;
+}
+
+const struct dom_filter_prefix *dom_prefix_lookup6(const struct dom_prefix_set *set, const struct in6_addr *daddr) {
+	u64 key[2] = { get_unaligned_be64(&daddr->s6_addr[0]), get_unaligned_be64(&daddr->s6_addr[8]) };
+	u32 v = dom_lpm_lookup(&set->v6, key);
+
+	return v ? &set->prefixes[v - 1] : NULL;
+}
+
+// Microbenchmark: echo 1000000 > /sys/module/domnetfilter/parameters/lpm_bench builds a set of
+// that many random IPv4 and as many random IPv6 prefixes off to the side (the live rules are
+// not touched), times lookups of random addresses and prints the results to the kernel log.
+#define DOM_LPM_BENCH_ADDRS	4096
+#define DOM_LPM_BENCH_LOOKUPS	(16 * 1024 * 1024)
+
+static void dom_lpm_bench_random(struct dom_filter_prefix *p, u8 family) {
+	memset(p, 0, sizeof(*p));
+	p->family = family;
+	p->action = DOM_FILTER_BLOCK;
+	prandom_bytes(p->addr, family == AF_INET ? 4 : 16);
+	// Mostly /24 and /48 like real tables, plus a spread of everything from /8 and /16 up
+	if (family == AF_INET)
+		p->len = prandom_u32_max(2) ? 24 : 8 + prandom_u32_max(25);
+	else
+		p->len = prandom_u32_max(2) ? 48 : 16 + prandom_u32_max(113);
+	dom_prefix_normalize(p);
+}
+
+static u64 dom_lpm_bench_run(const struct dom_lpm *t, const u64 (*keys)[2], u32 *matches) {
+	u64 start = ktime_get_ns();
+	u32 i, hit = 0;
+
+	for (i = 0; i < DOM_LPM_BENCH_LOOKUPS; i++)
+		hit += dom_lpm_lookup(t, keys[i & (DOM_LPM_BENCH_ADDRS - 1)]) != 0;
+	*matches = hit;
+	return ktime_get_ns() - start;
+}
+
+static int dom_lpm_bench(unsigned int nr) {
+	struct dom_filter_prefix *prefixes;
+	struct dom_prefix_set *set;
+	u64 (*keys)[2];
+	u64 build_ns, v4_ns, v6_ns;
+	u32 v4_hits, v6_hits;
+	unsigned int i;
+	int err = 0;
+
+	prefixes = kvmalloc_array(2 * nr, sizeof(*prefixes), GFP_KERNEL);
+	keys = kvmalloc_array(DOM_LPM_BENCH_ADDRS, sizeof(*keys), GFP_KERNEL);
+	if (prefixes == NULL || keys == NULL) {
+		err = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < nr; i++) {
+		dom_lpm_bench_random(&prefixes[i], AF_INET);
+		dom_lpm_bench_random(&prefixes[nr + i], AF_INET6);
+	}
+
+	build_ns = ktime_get_ns();
+	set = dom_prefix_set_build(prefixes, 2 * nr);
+	build_ns = ktime_get_ns() - build_ns;
+	if (IS_ERR(set)) {
+		err = PTR_ERR(set);
+		goto out;
+	}
+
+	for (i = 0; i < DOM_LPM_BENCH_ADDRS; i++) {
+		keys[i][0] = (u64)prandom_u32() << 32;
+		keys[i][1] = 0;
+	}
+	v4_ns = dom_lpm_bench_run(&set->v4, (const u64 (*)[2])keys, &v4_hits);
+	for (i = 0; i < DOM_LPM_BENCH_ADDRS; i++) {
+		// Inside 2000::/3 like real traffic, otherwise the v6 table is mostly missed at the root
+		keys[i][0] = ((u64)prandom_u32() << 32 | prandom_u32()) >> 3 | (1ULL << 61);
+		keys[i][1] = (u64)prandom_u32() << 32 | prandom_u32();
+	}
+	v6_ns = dom_lpm_bench_run(&set->v6, (const u64 (*)[2])keys, &v6_hits);
+
+	printk(KERN_INFO "domnetfilter: lpm_bench %u prefixes per family, built in %llu ms\n", nr, div_u64(build_ns, NSEC_PER_MSEC));
+	printk(KERN_INFO "domnetfilter: lpm_bench ipv4 %u nodes %u leaves, %llu lookups/s, %u%% matched\n",
+	       set->v4.nr_nodes, set->v4.nr_leaves, div64_u64((u64)DOM_LPM_BENCH_LOOKUPS * NSEC_PER_SEC, v4_ns ?: 1),
+	       (u32)div_u64((u64)v4_hits * 100, DOM_LPM_BENCH_LOOKUPS));
+	printk(KERN_INFO "domnetfilter: lpm_bench ipv6 %u nodes %u leaves, %llu lookups/s, %u%% matched\n",
+	       set->v6.nr_nodes, set->v6.nr_leaves, div64_u64((u64)DOM_LPM_BENCH_LOOKUPS * NSEC_PER_SEC, v6_ns ?: 1),
+	       (u32)div_u64((u64)v6_hits * 100, DOM_LPM_BENCH_LOOKUPS));
+	dom_prefix_set_free(set);
+out:
+	kvfree(keys);
+	kvfree(prefixes);
+	return err;
+}
+
+static unsigned int lpm_bench;
+
+static int dom_lpm_bench_set(const char *val, const struct kernel_param *kp) {
+	unsigned int nr;
+	int err = kstrtouint(val, 0, &nr);
+
+	if (err)
+		return err;
+	if (nr == 0 || nr > 4 * 1024 * 1024)
+		return -EINVAL;
+	err = dom_lpm_bench(nr);
+	if (err == 0)
+		lpm_bench = nr;
+	return err;
+}
+
+static const struct kernel_param_ops dom_lpm_bench_ops = {
+	.set = dom_lpm_bench_set,
+	.get = param_get_uint,
+};
+module_param_cb(lpm_bench, &dom_lpm_bench_ops, &lpm_bench, 0600);
+MODULE_PARM_DESC(lpm_bench, "Write a prefix count to benchmark prefix lookups, results go to the kernel log");
@@ -0,0 +1,25 @@
+// Longest prefix match for the domnetfilter CIDR rules, see filter_lpm.c
+
+#ifndef _DOM_FILTER_LPM_H
+#define _DOM_FILTER_LPM_H
+
+#include <linux/types.h>
+#include <linux/in6.h>
+
+#include "filter.h"
+
+struct dom_prefix_set;
+
+int dom_prefix_normalize(struct dom_filter_prefix *p);
+bool dom_prefix_equal(const struct dom_filter_prefix *a, const struct dom_filter_prefix *b);
+
+struct dom_prefix_set *dom_prefix_set_build(const struct dom_filter_prefix *prefixes, unsigned int nr);
+void dom_prefix_set_free(struct dom_prefix_set *set);
+unsigned int dom_prefix_set_size(const struct dom_prefix_set *set);
+const struct dom_filter_prefix *dom_prefix_set_prefixes(const struct dom_prefix_set *set);
+
+// Lockless, under rcu_read_lock. Return the longest prefix that covers daddr, or NULL.
+const struct dom_filter_prefix *dom_prefix_lookup4(const struct dom_prefix_set *set, __be32 daddr);
+const struct dom_filter_prefix *dom_prefix_lookup6(const struct dom_prefix_set *set, const struct in6_addr *daddr);
+
+#endif /* _DOM_FILTER_LPM_H */